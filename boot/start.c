@@ -163,8 +163,9 @@ void start()
     /* MIE */
     write_mstatus(read_mstatus() | MSTATUS_MIE);
 
-    /* Machine interrupt-enable register -> timer interrrupt enable */
-    write_mie(read_mie() | MIE_MTIE);
+    /* Machine interrupt-enable register -> timer interrrupt enable, 
+    software interrupt enable for IPIs sent through CLINT msip */
+    write_mie(read_mie() | MIE_MTIE | MIE_MSIE);
 
     /* return to main function in supervisor mode */
     asm volatile("mret");
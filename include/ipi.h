@@ -0,0 +1,49 @@
+#ifndef _ipi_h_
+#define _ipi_h_
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+
+/* Request bits in a hart's mailbox */
+#define IPI_TLB (1 << 0)  // TLB shootdown
+
+/* Pages one shootdown request can name before it becomes a full flush */
+#define TLB_BATCH 16
+/* nva of a request that flushes the whole ASID */
+#define TLB_FLUSH_ASID (-1)
+/* asid of a request that flushes every ASID */
+#define TLB_ASID_ALL (~0UL)
+
+/* Per-hart request mailbox, written by senders under lock */
+struct ipi_mbox {
+  struct spinlock lock;
+  uint32_t pending;           // IPI_* bits not yet picked up
+  uint64_t seq;               // requests posted so far
+  volatile uint64_t done;     // requests completed so far
+  /* pending TLB shootdown, requests from several senders are merged */
+  uint64_t asid;
+  int nva;
+  uint64_t va[TLB_BATCH];
+} __attribute__((aligned(64)));
+
+/* Pages to invalidate in one address space, collected and then sent as 
+one IPI per hart that may cache them */
+struct tlb_batch {
+  proc_t *proc;               // address space, 0 for the kernel page table
+  int nva;                    // TLB_FLUSH_ASID once more than TLB_BATCH
+  uint64_t va[TLB_BATCH];
+};
+
+void ipi_init();
+void ipi_init_hart();
+void ipi_send(int hart);
+void ipi_handle();
+void tlb_batch_init(struct tlb_batch *b, proc_t *proc);
+void tlb_batch_add(struct tlb_batch *b, uint64_t va);
+void tlb_batch_add_range(struct tlb_batch *b, uint64_t start, uint64_t end);
+void tlb_batch_flush(struct tlb_batch *b);
+void tlb_shootdown_page(proc_t *proc, uint64_t va);
+
+#endif
@@ -1,8 +1,20 @@
 #ifndef _kmalloc_h_
 #define _kmalloc_h_
 
+/* Largest block order kmalloc_pages() can hand out (2^10 pages = 4 MiB) */
+#define KMALLOC_MAX_ORDER 10
+
 void pm_init();
 void* kmalloc();
 void kfree(void *pa);
+void* kzalloc();
+int kzalloc_refill();
+void* kmalloc_pages(int order);
+void kfree_pages(void *pa, int order);
+void kmalloc_dump();
+void kfree_bulk(void **pages, int n);
+void kpage_share(void *pa);
+int kpage_unshare(void *pa);
+int kpage_refs(void *pa);
 
 #endif
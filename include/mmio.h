@@ -7,5 +7,7 @@
 #define mm_readb(addr) *(volatile uint8_t *)(addr)
 #define mm_writew(addr, val) *(volatile uint32_t *)(addr) = val
 #define mm_readw(addr) *(volatile uint32_t *)(addr)
+#define mm_writed(addr, val) *(volatile uint64_t *)(addr) = val
+#define mm_readd(addr) *(volatile uint64_t *)(addr)
 
 #endif
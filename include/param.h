@@ -2,6 +2,4 @@
 #define _param_h_
 
 #define NCORE    8   // max number of cores
-#define NPROC    64  // max number of processes
-
 #endif
@@ -5,11 +5,14 @@
 #include "../include/param.h"
 #include "../include/spinlock.h"
 #include "../include/vm.h"
-
+#include "../include/rbtree.h"
 #define pid_t int
 
 enum proc_state { INITED, PICKED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+/* Buckets in the PID lookup table, a power of 2 */
+#define PID_HASH 64
+
 struct context {
   uint64_t ra;
   uint64_t sp;
@@ -29,6 +32,12 @@ struct context {
   uint64_t s11;
 };
 
+/* FP registers and fcsr, saved lazily (see fp_switch_out()) */
+struct fpstate {
+  uint64_t f[32];
+  uint64_t fcsr;
+};
+
 struct trapframe {
   /*   0 */ uint64_t kernel_satp;   // kernel page table
   /*   8 */ uint64_t kernel_sp;     // top of process's kernel stack
@@ -84,22 +93,80 @@ typedef struct proc {
 
   // these are private to the process, so p->lock need not be held.
   uint64_t kstack;               // Virtual address of kernel stack
+  void *kstack_pa;               // Pages backing kstack, 0 until first use
   uint64_t sz;                   // Size of process memory (bytes)
   ptb_t pagetable;             // User page table
+  uint64_t asid;               // ASID generation << 16 | hardware ASID, 0 if none
+  uint64_t cpumask;            // Cores that may cache translations of pagetable
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  struct fpstate fp;           // FP state while not live in some core
+  int fp_cpu;                  // Core whose FP registers hold proc's state, -1 if none
+  // the run queue lock of p->cpu protects these:
+  const struct sched_class *sclass; // Scheduling class
+  int on_rq;                   // Queued, not running
+  int pinned;                  // Never stolen by another core
+  int nice;                    // -20 (most CPU) to 19 (least CPU)
+  uint32_t weight;             // Load weight derived from nice
+  uint64_t vruntime;           // Runtime in mtime units scaled by NICE_0_LOAD/weight
+  uint64_t exec_start;         // mtime when runtime was last charged
+  uint64_t sum_exec;           // Total runtime in mtime units
+  uint64_t slice_start;        // sum_exec when last picked
+  struct rb_node rb;           // Node in the tree of proc's class
+  uint64_t dl_runtime;         // Deadline class: budget per period
+  uint64_t dl_deadline;        //   relative deadline
+  uint64_t dl_period;          //   reservation period
+  uint64_t deadline;           //   current absolute deadline
+  long runtime_left;           //   budget left before deadline
+  int dl_throttled;            //   out of budget until deadline
+  struct proc *dl_next;        //   throttled list link
+  struct proc *pid_next;       // PID hash chain, bucket lock protects it
+  struct proc *free_next;      // Free list, free_lock protects it
+  struct proc *wait_next;      // Wait queue link, its bucket lock protects it
+  int cpu;                     // Core that ran or queued the process last
   // struct file *ofile[NOFILE];  // Open files TODO
   // struct inode *cwd;           // Current directory TODO
+  void (*kfn)(void *arg);      // Kernel thread body, 0 for user processes
+  void *karg;                  // Its argument
   char name[16];               // Process name (debugging)
 }proc_t;
 
 
+/* Fair class part of a run queue, processes ordered by vruntime */
+struct cfs_rq {
+  struct rb_root tasks;
+  uint64_t min_vruntime;       // Monotonic floor of vruntimes on this core
+  uint64_t load;               // Sum of queued weights
+};
+
+/* Deadline class part of a run queue, processes ordered by deadline */
+struct dl_rq {
+  struct rb_root tasks;
+  struct proc *throttled;      // Out of budget, waiting for their deadline
+  uint64_t bw;                 // Admitted bandwidth, DL_BW_SHIFT fixed point
+};
+
+/* Per-core queue of RUNNABLE processes, one part per scheduling class */
+struct runqueue {
+  struct spinlock lock;
+  volatile int nr;             // pickable processes, read unlocked by stealers
+  volatile int nr_pinned;      // of those, ones that may not migrate
+  struct dl_rq dl;
+  struct cfs_rq cfs;
+} __attribute__((aligned(64)));
+
 /* Per-Core state */
 typedef struct core {
   struct proc *proc;
+  struct runqueue rq;
+  volatile int idle;           // parked in wfi, kick with an IPI
+  volatile int need_resched;   // current process should give up the core
+  int preempt_cnt;             // preempt_disable() depth, 0 if preemptible
+  struct proc *fpowner;        // Last process to load this core's FP registers
   struct context context; 
   int disable_cnt;                
   int prev_int_state;        
+  uint64_t asid_gen;           // ASID generation this core's TLB is clean for
 }core_t;
 
 extern struct core cores[NCORE];
@@ -109,10 +176,19 @@ struct core* get_mycore();
 struct proc* get_myproc();
 pid_t next_pid();
 void proc_init();
+void proc_freepagetable(proc_t* proc);
 void restore_proc(proc_t* proc);
+int prep_kstack(proc_t* proc);
 int prep_trap_frame(proc_t* proc);
 int prep_page_table(proc_t* proc);
 struct proc* get_new_proc();
-void start_proc();
+proc_t* kthread_create(void (*fn)(void*), void *arg, char *name, int pinned);
+void kthread_exit();
+void proc_exit(int status);
+proc_t* find_proc(pid_t pid);
+void start_proc(proc_t* proc);
+int grow_proc(proc_t* proc, long n);
+uint64_t proc_satp(proc_t* proc);
+void proc_flush_tlb(proc_t* proc);
 
 #endif
\ No newline at end of file
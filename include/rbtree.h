@@ -0,0 +1,36 @@
+#ifndef _rbtree_h_
+#define _rbtree_h_
+
+#include "types.h"
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+/* Red-black tree node, embedded in the structure it orders */
+struct rb_node {
+  struct rb_node *parent;
+  struct rb_node *left;
+  struct rb_node *right;
+  int color;
+};
+
+/* Tree root, the leftmost (smallest) node is cached for O(1) rb_first() */
+struct rb_root {
+  struct rb_node *node;
+  struct rb_node *leftmost;
+};
+
+/* Structure containing the node ptr points at */
+#define rb_entry(ptr, type, member) \
+  ((type*)((char*)(ptr) - __builtin_offsetof(type, member)))
+
+#define rb_first(root) ((root)->leftmost)
+#define rb_empty(root) ((root)->node == 0)
+
+void rb_init(struct rb_root *root);
+void rb_insert(struct rb_root *root, struct rb_node *node, 
+               int (*less)(struct rb_node *a, struct rb_node *b));
+void rb_erase(struct rb_root *root, struct rb_node *node);
+struct rb_node* rb_next(struct rb_node *node);
+
+#endif
@@ -14,6 +14,7 @@
 #define MSTATUS_MPP_USER (0L << 11)
 
 /* MIE related */
+#define MIE_MSIE (1L << 3)
 #define MIE_MTIE (1L << 7)
 
 /* PMPXCFG related */
@@ -23,9 +24,25 @@
 #define PMPXCFG_A_TOR (1 << 3)
 #define PMPXCFG_L (1 << 7)
 
+/* SATP related */
+#define SATP_SV39 (8L << 60)
+#define SATP_ASID_SHIFT 44
+/* ASID field is 16 bits wide, hardware may implement fewer */
+#define SATP_ASID_MASK 0xFFFFL
+#define MAKE_SATP(pagetable, asid) \
+  (SATP_SV39 | (((uint64_t)(asid) & SATP_ASID_MASK) << SATP_ASID_SHIFT) | (((uint64_t)(pagetable)) >> 12))
+#define GET_SATP_ASID(satp) (((satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK)
+
 /* SSTATUS related */
 #define SSTATUS_SIE (1L << 1)  
-
+#define SSTATUS_SPIE (1L << 5)  // interrupts on after sret
+#define SSTATUS_SPP (1L << 8)   // sret to supervisor (1) or user (0)
+/* Floating-point unit status, FS is Off/Initial/Clean/Dirty */
+#define SSTATUS_FS (3L << 13)
+#define SSTATUS_FS_OFF (0L << 13)
+#define SSTATUS_FS_INITIAL (1L << 13)
+#define SSTATUS_FS_CLEAN (2L << 13)
+#define SSTATUS_FS_DIRTY (3L << 13)
 /**
  *+--------------------------------------+
  *             Memory related            *
@@ -128,6 +145,39 @@ FUNC_WRITE_CSR(stvec)
 FUNC_WRITE_CSR(sepc)
 
 
+/* Supervisor interrupts on/off on the current hart */
+static inline void intr_on(){
+    write_sstatus(read_sstatus() | SSTATUS_SIE);
+}
+
+static inline void intr_off(){
+    write_sstatus(read_sstatus() & ~SSTATUS_SIE);
+}
+
+/* Stall until an interrupt enabled in sie is pending, even with 
+SSTATUS_SIE clear */
+static inline void wfi(){
+    asm volatile("wfi" ::: "memory");
+}
+
+/* TLB flushes: everything, one page in every address space, one 
+address space, or one page in one address space */
+static inline void sfence_vma_all(){
+    asm volatile("sfence.vma zero, zero" ::: "memory");
+}
+
+static inline void sfence_vma_page(uint64_t va){
+    asm volatile("sfence.vma %0, zero" :: "r" (va) : "memory");
+}
+
+static inline void sfence_vma_asid(uint64_t asid){
+    asm volatile("sfence.vma zero, %0" :: "r" (asid) : "memory");
+}
+
+static inline void sfence_vma_page_asid(uint64_t va, uint64_t asid){
+    asm volatile("sfence.vma %0, %1" :: "r" (va), "r" (asid) : "memory");
+}
+
 FUNC_READ_GP(tp)
 FUNC_READ_GP(sp)
 FUNC_READ_GP(ra)
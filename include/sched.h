@@ -0,0 +1,75 @@
+#ifndef _sched_h_
+#define _sched_h_
+
+#include "proc.h"
+
+/* rq_enqueue() flags */
+#define ENQUEUE_NEW    (1 << 0)  // first time runnable
+#define ENQUEUE_WAKEUP (1 << 1)  // back from sleep()
+
+/* 
+A scheduling policy. The pick path asks each class in priority order, 
+following next, until one has something to run. All hooks run with the 
+run queue lock held.
+*/
+struct sched_class {
+  const struct sched_class *next;   // next lower priority class
+  int pinned;                       // processes never leave their core
+  /* add proc to rq, return 0 if it is parked instead of pickable */
+  int (*enqueue)(struct runqueue *rq, proc_t *proc, int flags);
+  /* remove and return the process to run next, 0 if none. A stealing 
+  core sets steal, pinned processes must be passed over then */
+  proc_t* (*pick)(struct runqueue *rq, int steal);
+  /* charge proc, running on rq's core, for its time since the last call */
+  void (*update)(struct runqueue *rq, proc_t *proc);
+  /* periodic accounting for the running proc, may set need_resched. 
+  Re-requests the timer event that ends proc's budget or slice */
+  void (*tick)(struct runqueue *rq, proc_t *proc);
+  /* proc, already picked from one core, is moved to another */
+  void (*migrate)(struct runqueue *from, struct runqueue *to, proc_t *proc);
+  /* optional, on every tick of rq's core, return how many parked 
+  processes became pickable. Re-requests the timer event of the next 
+  one still parked */
+  int (*timer)(struct runqueue *rq);
+};
+
+/* proc may not leave the core it is queued on */
+#define PROC_PINNED(proc) ((proc)->sclass->pinned || (proc)->pinned)
+
+/* Core a run queue belongs to */
+#define RQ_CORE(rq) ((core_t*)((char*)(rq) - __builtin_offsetof(core_t, rq)))
+
+extern const struct sched_class dl_sched_class;
+extern const struct sched_class fair_sched_class;
+#define sched_class_highest (&dl_sched_class)
+
+/* Deadline class bandwidth is runtime/period in 1 << DL_BW_SHIFT units, 
+DL_BW_MAX of each hart may be reserved, the rest is left to the fair 
+class */
+#define DL_BW_SHIFT 20
+#define DL_BW_MAX ((95L << DL_BW_SHIFT) / 100)
+/* Load weight of nice 0 */
+#define NICE_0_LOAD 1024
+void swtch(struct context *old, struct context *new);
+void fp_save(struct fpstate *fp);
+void fp_restore(struct fpstate *fp);
+void fp_switch_in(proc_t* proc);
+void fp_switch_out(proc_t* proc);
+int fp_trap(proc_t* proc);
+void sched_init();
+void sched_proc_init(proc_t* proc);
+void sched_tick();
+void cfs_rq_init(struct cfs_rq *cfs);
+int set_nice(proc_t* proc, int nice);
+void dl_rq_init(struct dl_rq *dl);
+void dl_release(proc_t* proc);
+int set_deadline(proc_t* proc, uint64_t runtime, uint64_t deadline, uint64_t period);
+void rq_enqueue(int coreid, proc_t* proc, int flags);
+proc_t* rq_dequeue(int coreid, int steal);
+void scheduler();
+void sched();
+void yield();
+void preempt_schedule();
+void sleep(void *chan, struct spinlock *lk);
+void wakeup(void *chan);
+#endif
@@ -0,0 +1,44 @@
+#ifndef _slab_h_
+#define _slab_h_
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+
+/* Objects a core may keep in its private cache */
+#define KMEM_CPU_CACHE 16
+/* Objects moved between a core cache and the slabs at once */
+#define KMEM_CPU_BATCH (KMEM_CPU_CACHE/2)
+/* Largest size served by kmem_alloc() size classes */
+#define KMEM_MAX_SIZE  1024
+
+/* Per-core object cache, only touched by its core with interrupts off */
+struct kmem_cpu {
+  int cnt;
+  void *objs[KMEM_CPU_CACHE];
+} __attribute__((aligned(64)));
+
+/* A cache of equally sized objects carved out of kmalloc_pages() blocks */
+struct kmem_cache {
+  char *name;
+  uint32_t size;              // object size, rounded up to 8 bytes
+  uint32_t order;             // each slab is 2^order pages
+  uint32_t per_slab;          // objects per slab
+  uint32_t offset;            // offset of the first object in a slab
+  void (*ctor)(void *obj);    // run once when a slab is created
+
+  struct spinlock lock;       // protects the slab lists below
+  struct slab *partial;       // slabs with at least one free object
+  struct slab *empty;         // one fully free slab kept for reuse
+
+  struct kmem_cpu cpu[NCORE];
+};
+
+void kmem_init();
+void kmem_cache_init(struct kmem_cache *cache, char *name, uint32_t size, void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void* kmem_alloc(uint32_t size);
+void kmem_free(void *obj);
+
+#endif
@@ -9,7 +9,9 @@ struct spinlock{
 
 void intr_push();
 void intr_pop();
-int cpu_holding(struct spinlock *lock);
+void preempt_disable();
+void preempt_enable();
+int core_holding(struct spinlock *lock);
 void spinlock_init(struct spinlock* lock);
 void acquire_spinlock(struct spinlock* lock);
 void release_spinlock(struct spinlock* lock);
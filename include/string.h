@@ -2,5 +2,6 @@
 #define _string_h_
 
 void* memset(void *ptr, int c, unsigned int len);
+void* memcpy(void *dst, const void *src, unsigned int len);
 
 #endif
\ No newline at end of file
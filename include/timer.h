@@ -1,14 +1,29 @@
 #ifndef _timer_h_
 #define _timer_h_
 
+#include "types.h"
+
 #define CLINT 0x2000000L
 #define TIMER_INTERVAL 1000000
 #define CLINT_MTIME 0x200BFF8L
+/* mtime ticks per second on the QEMU virt machine */
+#define MTIME_FREQ 10000000
 #define MTIMECMP_BASE 0x2004000L
 
+/* msip (software interrupt pending) for different cores starting from 0x2000000 */
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
+
 /* mtimecmp for different cores starting from 0x2004000 */
 #define CLINT_MTIMECMP(hartid) (MTIMECMP_BASE + 8*(hartid))
 
+/* No timer event pending, also parks mtimecmp */
+#define TIMER_NONE (~0UL)
+
 void timer_init();
+uint64_t timer_now();
+void timer_request(uint64_t deadline);
+int timer_handle();
+void timer_periodic();
+void timer_tickless();
 
 #endif
@@ -7,13 +7,18 @@
 
 
 /* Not interrupt cause */
+#define CAUSE_ILLEGAL_INST 2
 #define CAUSE_ENV_CALL 8
+#define CAUSE_LOAD_PAGE_FAULT 13
+#define CAUSE_STORE_PAGE_FAULT 15
 
 #define IS_INTERRUPT(cause) ((cause) &  (1L<<63))
 #define GET_EXP_CODE(cause) ((cause) & ~(1L<<63))
 
 void user_trap();
+void usertrapret();
 void kernel_trap();
 void trap_init();
+void trap_init_hart();
 
 #endif
\ No newline at end of file
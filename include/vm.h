@@ -19,6 +19,15 @@ typedef uint64_t pte_t;
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4)
 #define PTE_PT (1L << 5)
+/* RSW bit: read-only page shared copy-on-write, writable after a copy */
+#define PTE_COW (1L << 8)
+
+/* map_pages perm flag: use 2 MiB / 1 GiB leaves wherever va, pa and 
+size are aligned for them. Only for kernel mappings, everything that 
+walks user tables expects 4096 bytes leaves */
+#define MAP_SUPER (1 << 16)
+/* PTE bits that map_pages copies from perm */
+#define PTE_FLAGS 0x3FF
 
 /* Allocate page table */
 #define PG_ALLOC 1
@@ -35,21 +44,48 @@ typedef uint64_t pte_t;
 #define PTE_EXE(pte) ((pte) & (PTE_X))
 /* PTE user access */
 #define PTE_USER(pte) ((pte) & (PTE_U))
+/* A valid PTE with any of R/W/X is a leaf, otherwise it points to the 
+next level of page table */
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
 
 /* Extract the page table index for a certain level */
 #define GET_PT_IDX(va, level) ((va >> ((level * PTIDX_LEN) + PG_OFFSET)) & (PTIDX_MASK))
+/* Bytes mapped by one leaf PTE at a level: 4 KiB, 2 MiB or 1 GiB */
+#define LEVEL_SIZE(level) (1UL << (PG_OFFSET + (level) * PTIDX_LEN))
+/* Buddy order of a 2 MiB superpage: it spans the 2^PTIDX_LEN pages a 
+level-0 table would map */
+#define SUPERPAGE_ORDER PTIDX_LEN
 /* Round an address to a boundary */
 #define ADDR_ROUND(address, target, dir) ((dir) ? ((address+target-1) & ~(target-1)) : (address & (~(target-1))))
 /* Get pa from PTE */
 #define GET_PA(pte) (((pte) >> 10) << 12)
 /* Get PTE from pa */
 #define GET_PTE(pa) ((((uint64_t)pa) >> 12) << 10)
-/* Get process' kernel stack */
-#define GET_PROC_KSTACK(num) (TRAP - (PSIZE*((num+1)*2)))
+/* User memory [0, sz) must stay below the trap frame */
+#define MAXUVA TRAP_FRAME
+/* One kernel stack is 2^KSTACK_ORDER pages */
+#define KSTACK_ORDER 0
+#define KSTACK_PAGES (1 << KSTACK_ORDER)
+/* Kernel stacks are handed out downwards from TRAP, within 
+[KSTACK_BOTTOM, TRAP). Each slot takes KSTACK_PAGES plus one page that 
+is never mapped, so a stack overflow faults on the guard page instead 
+of running into the next stack */
+#define KSTACK_SLOT (PSIZE*(KSTACK_PAGES+1))
+#define KSTACK_BOTTOM (MAXVA >> 1)
 
 pte_t* search_pt_tree(ptb_t pagetable, uint64_t va, int alloc);
-int map_pages(ptb_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm, char* purp);
-int unmap_pages(ptb_t pagetable, uint64_t va, uint64_t size);
+pte_t* search_pt_level(ptb_t pagetable, uint64_t va, int *level, int alloc);
+int map_pages(ptb_t pagetable, uint64_t asid, uint64_t va, uint64_t size, uint64_t pa, int perm, char* purp);
+int unmap_pages(ptb_t pagetable, uint64_t asid, uint64_t va, uint64_t size);
+int uvm_cow_copy(ptb_t old, ptb_t new, uint64_t sz);
+int cow_fault(ptb_t pagetable, uint64_t va);
+int lazy_fault(ptb_t pagetable, uint64_t sz, uint64_t va);
+void uvm_dealloc(ptb_t pagetable, uint64_t oldsz, uint64_t newsz);
+void uvm_free(ptb_t pagetable);
+int copyout(ptb_t pagetable, uint64_t dstva, const char *src, uint64_t len);
+int copyin(ptb_t pagetable, char *dst, uint64_t srcva, uint64_t len);
+int copyinstr(ptb_t pagetable, char *dst, uint64_t srcva, uint64_t max);
 void kernel_vm_init();
+void kernel_vm_init_hart();
 
 #endif
\ No newline at end of file
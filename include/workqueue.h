@@ -0,0 +1,30 @@
+#ifndef _workqueue_h_
+#define _workqueue_h_
+
+#include "types.h"
+#include "spinlock.h"
+#include "proc.h"
+
+/* Deferred work item, usually embedded in the structure it works on */
+struct work {
+  void (*fn)(struct work *work);
+  struct work *next;
+  volatile int pending;        // queued and not yet started
+};
+
+/* Per-core queue of work, drained by that core's worker thread */
+struct workqueue {
+  struct spinlock lock;
+  struct work *head;
+  struct work *tail;
+  int sleeping;                // worker waits in sleep(), needs a wakeup
+  proc_t *worker;              // pinned, so work runs on the core that queued it
+} __attribute__((aligned(64)));
+
+#define WORK_INIT(w, f) do { (w)->fn = (f); (w)->next = 0; (w)->pending = 0; } while (0)
+
+void workqueue_init();
+void workqueue_init_hart();
+int queue_work(struct work *work);
+
+#endif
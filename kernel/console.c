@@ -4,7 +4,8 @@
 #include "../include/uart.h"
 #include "../include/types.h"
 #include "../include/printk.h"
-
+#include "../include/kmalloc.h"
+#include "../include/workqueue.h"
 #define LINESIZE 16
 static char line[LINESIZE];
 static int head = 0;
@@ -25,14 +26,20 @@ void console_putc(int c){
 #define BACKSPACE '\b'
 #define Ctrl(x)  ((x)-'@')  // Control-x
 
-// called by uart isr
-void console_isr(char c) {
-    acquire_spinlock(&console_lock);
+/* Characters received by the uart isr, not yet processed */
+#define RXSIZE 64
+static char rx[RXSIZE];
+static uint32_t rx_r, rx_w;
+static struct spinlock rx_lock;
+static struct work console_work;
 
+/* Echo and line editing for one input character */
+static void console_char(char c) {
     switch (c)
     {
         case Ctrl('P'):
             printk("procdump\n");
+            kmalloc_dump();
             break;
         
         case Ctrl('U'):
@@ -70,14 +77,42 @@ void console_isr(char c) {
             }
             break;
     }
+}
+
+/* Worker side: process everything received so far */
+static void console_process(struct work *work) {
+    char buf[RXSIZE];
+    int n = 0;
+
+    acquire_spinlock(&rx_lock);
+    while (rx_r != rx_w)
+        buf[n++] = rx[rx_r++ % RXSIZE];
+    release_spinlock(&rx_lock);
 
-    release_spinlock(&console_lock);
-    
+    /* Lock per character so interrupts come back on in between */
+    for (int i = 0; i < n; i++){
+        acquire_spinlock(&console_lock);
+        console_char(buf[i]);
+        release_spinlock(&console_lock);
+    }
+}
+
+/* Called by the uart isr. Only buffers the character, echo and line 
+   editing wait for the worker so the interrupt stays short. A full 
+   buffer drops input. */
+void console_isr(char c) {
+    acquire_spinlock(&rx_lock);
+    if (rx_w - rx_r < RXSIZE)
+        rx[rx_w++ % RXSIZE] = c;
+    release_spinlock(&rx_lock);
+    queue_work(&console_work);
 }
 
 void console_init(void)
 {
   spinlock_init(&console_lock);
+  spinlock_init(&rx_lock);
+  WORK_INIT(&console_work, console_process);
   uart_init();
 
 //   // connect read and write system calls
@@ -9,7 +9,9 @@
 #include "../include/printk.h"
 #include "../include/spinlock.h"
 #include "../include/kmalloc.h"
+#include "../include/slab.h"
 #include "../include/string.h"
+#include "../include/sched.h"
 
 
 static struct disk {
@@ -114,14 +116,16 @@ void disk_init() {
     if(max < NUMDESC)
         kerror(__FILE_NAME__,__LINE__,"virtio max queue too short");
 
-    disk.desc = kmalloc();
-    disk.avail = kmalloc();
-    disk.used = kmalloc();
+    /* The rings are far smaller than a page, slab objects keep the 
+    alignment virtio needs (16 for desc, 2 for avail, 4 for used) */
+    disk.desc = kmem_alloc(NUM * sizeof(struct virtq_desc));
+    disk.avail = kmem_alloc(sizeof(struct virtq_avail));
+    disk.used = kmem_alloc(sizeof(struct virtq_used));
     if(!disk.desc || !disk.avail || !disk.used)
         kerror(__FILE_NAME__,__LINE__,"virtio disk kalloc");
-    memset(disk.desc, 0, PSIZE);
-    memset(disk.avail, 0, PSIZE);
-    memset(disk.used, 0, PSIZE);
+    memset(disk.desc, 0, NUM * sizeof(struct virtq_desc));
+    memset(disk.avail, 0, sizeof(struct virtq_avail));
+    memset(disk.used, 0, sizeof(struct virtq_used));
 
     mm_writew(VIRTIO_ADDR(VIRTIO_QUEUE_SIZE),NUM);
 
@@ -165,7 +169,7 @@ static void free_desc(int i){
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-//   wakeup(&disk.free[0]);
+  wakeup(&disk.free[0]);
 }
 
 // // free a chain of descriptors.
@@ -0,0 +1,187 @@
+/*
+ * ipi.c - Inter-processor interrupts and TLB shootdown
+ *
+ * S-mode raises an IPI by writing 1 to the target hart's CLINT MSIP 
+ * register. That is a machine software interrupt, which mti_handler 
+ * clears and forwards to S-mode as a supervisor software interrupt, the 
+ * same way timer ticks arrive. kernel_trap() then calls ipi_handle() to 
+ * serve whatever was posted in the hart's mailbox.
+ */
+#include "../include/ipi.h"
+#include "../include/riscv.h"
+#include "../include/mmio.h"
+#include "../include/timer.h"
+#include "../include/spinlock.h"
+#include "../include/proc.h"
+#include "../include/kerror.h"
+
+struct ipi_mbox mboxes[NCORE];
+/* Harts that have booted and take interrupts */
+volatile uint64_t online_mask;
+
+void ipi_init(){
+  for (int i = 0; i < NCORE; i++){
+    spinlock_init(&mboxes[i].lock);
+    mboxes[i].pending = 0;
+    mboxes[i].seq = mboxes[i].done = 0;
+  }
+}
+
+/* Mark the current hart as able to receive IPIs */
+void ipi_init_hart(){
+  __sync_fetch_and_or(&online_mask, 1UL << get_coreid());
+}
+
+/* Raise a software interrupt on hart */
+void ipi_send(int hart){
+  mm_writew(CLINT_MSIP(hart), 1);
+}
+
+/* Serve the requests posted to this hart. Called from kernel_trap() on a 
+software interrupt and by senders while they wait, so that two harts 
+shooting down each other do not deadlock. */
+void ipi_handle(){
+  struct ipi_mbox *m;
+  uint64_t va[TLB_BATCH], asid = 0, seq;
+  uint32_t pending;
+  int nva = 0;
+
+  intr_push();
+  m = &mboxes[get_coreid()];
+  acquire_spinlock(&m->lock);
+  pending = m->pending;
+  seq = m->seq;
+  if (pending & IPI_TLB){
+    asid = m->asid;
+    nva = m->nva;
+    for (int i = 0; i < nva; i++)
+      va[i] = m->va[i];
+  }
+  m->pending = 0;
+  release_spinlock(&m->lock);
+
+  if (pending & IPI_TLB){
+    if (asid == TLB_ASID_ALL)
+      sfence_vma_all();
+    else if (nva == TLB_FLUSH_ASID)
+      sfence_vma_asid(asid);
+    else
+      for (int i = 0; i < nva; i++)
+        sfence_vma_page_asid(va[i], asid);
+  }
+
+  /* Everything up to seq is done, let the senders go */
+  if (pending){
+    __sync_synchronize();
+    m->done = seq;
+  }
+  intr_pop();
+}
+
+void tlb_batch_init(struct tlb_batch *b, proc_t *proc){
+  b->proc = proc;
+  b->nva = 0;
+}
+
+/* Queue va for invalidation, a batch that overflows flushes the ASID */
+void tlb_batch_add(struct tlb_batch *b, uint64_t va){
+  if (b->nva == TLB_FLUSH_ASID)
+    return;
+  if (b->nva == TLB_BATCH){
+    b->nva = TLB_FLUSH_ASID;
+    return;
+  }
+  b->va[b->nva++] = va;
+}
+
+/* Queue the pages of [start, end) for invalidation */
+void tlb_batch_add_range(struct tlb_batch *b, uint64_t start, uint64_t end){
+  start = start & ~((uint64_t)PSIZE - 1);
+  if ((end - start) / PSIZE > TLB_BATCH){
+    b->nva = TLB_FLUSH_ASID;
+    return;
+  }
+  for (; start < end; start += PSIZE)
+    tlb_batch_add(b, start);
+}
+
+/* Merge a request into hart's mailbox. Return the sequence number the 
+hart has to reach for it to be done. */
+static uint64_t mbox_post(int hart, uint64_t asid, struct tlb_batch *b){
+  struct ipi_mbox *m = &mboxes[hart];
+  uint64_t seq;
+
+  acquire_spinlock(&m->lock);
+  if (!(m->pending & IPI_TLB)){
+    m->pending |= IPI_TLB;
+    m->asid = asid;
+    m->nva = 0;
+  }
+  if (m->asid != asid){
+    /* Two address spaces in one request, just flush everything */
+    m->asid = TLB_ASID_ALL;
+  } else if (m->nva != TLB_FLUSH_ASID){
+    if (b->nva == TLB_FLUSH_ASID || m->nva + b->nva > TLB_BATCH){
+      m->nva = TLB_FLUSH_ASID;
+    } else {
+      for (int i = 0; i < b->nva; i++)
+        m->va[m->nva++] = b->va[i];
+    }
+  }
+  seq = ++m->seq;
+  release_spinlock(&m->lock);
+  return seq;
+}
+
+/* 
+Invalidate the batch on every other hart that may cache translations of 
+its address space: one IPI per target hart for the whole batch, then wait 
+until all targets are done. The calling hart flushes its own TLB itself. 
+Harts that never ran the address space are left alone.
+The caller must hold no spinlock: a target spinning on it with 
+interrupts off would never answer, and both harts would hang.
+*/
+void tlb_batch_flush(struct tlb_batch *b){
+  uint64_t seqs[NCORE], targets, asid;
+  int self;
+
+  if (b->nva == 0)
+    return;
+  if (get_mycore()->disable_cnt)
+    kerror(__FILE_NAME__,__LINE__,"tlb_batch_flush: spinlock held");
+  intr_push();
+  self = get_coreid();
+  if (b->proc){
+    targets = b->proc->cpumask;
+    asid = b->proc->asid ? (b->proc->asid & SATP_ASID_MASK) : TLB_ASID_ALL;
+  } else {
+    /* Kernel page table, every hart uses it under ASID 0 */
+    targets = ~0UL;
+    asid = 0;
+  }
+  targets &= online_mask & ~(1UL << self);
+
+  for (int i = 0; i < NCORE; i++){
+    if (!(targets & (1UL << i)))
+      continue;
+    seqs[i] = mbox_post(i, asid, b);
+    ipi_send(i);
+  }
+  for (int i = 0; i < NCORE; i++){
+    if (!(targets & (1UL << i)))
+      continue;
+    while (mboxes[i].done < seqs[i])
+      ipi_handle();
+  }
+  intr_pop();
+  b->nva = 0;
+}
+
+/* Shoot down a single page of proc on the harts that ran it */
+void tlb_shootdown_page(proc_t *proc, uint64_t va){
+  struct tlb_batch b;
+
+  tlb_batch_init(&b, proc);
+  tlb_batch_add(&b, va);
+  tlb_batch_flush(&b);
+}
@@ -9,6 +9,9 @@
 #include "../include/spinlock.h"
 #include "../include/printk.h"
 #include "../include/kerror.h"
+#include "../include/param.h"
+#include "../include/proc.h"
+#include "../include/timer.h"
 
 
 
@@ -32,28 +35,216 @@ extern char free_start[];
 /* Free memory ending point (in link.ld) */
 extern char end[];
 
-/* Physical memory block */
+/* Physical memory block, the first bytes of every free page. prev is 
+only meaningful while the block sits on a buddy free list. */
 struct block{
     struct block* next;
+    struct block* prev;
 };
 
+/* Number of pages moved between a core cache and the buddy lists at once */
+#define PCACHE_BATCH 16
+/* A core cache holding more pages than this drains one batch back */
+#define PCACHE_HIGH  (PCACHE_BATCH*4)
+
+/* 
+Per-core page cache and allocation counters. Only touched by its own 
+core with interrupts off, so no lock is needed. Aligned so that caches 
+of different cores never share a cache line.
+*/
+struct pcache {
+  struct block *list;
+  int cnt;
+  uint64_t allocs;  // successful kmalloc()/kmalloc_pages() calls
+  uint64_t frees;   // kfree()/kfree_pages() calls
+  uint64_t fails;   // allocations that found no memory
+} __attribute__((aligned(64)));
+
+/* Number of 4096 bytes pages in RAM */
+#define NPAGES ((PHYSTOP - KBASE) / PSIZE)
+/* Page index of a physical address, blocks are aligned relative to KBASE */
+#define PAGE_IDX(pa) (((uint64_t)(pa) - KBASE) / PSIZE)
+/* Physical address of a page index */
+#define IDX_PAGE(idx) ((struct block*)(KBASE + (uint64_t)(idx) * PSIZE))
+/* pg_order flag: page heads a free block of order (pg_order & ~PG_FREE) */
+#define PG_FREE 0x80
+
+/* Pages kept zeroed ahead of time for kzalloc() */
+#define ZPOOL_HIGH 64
+
+/* Pool of zeroed pages. Apart from the link word, which kzalloc() 
+clears on the way out, every page on the list is all zero. */
+struct {
+  struct spinlock lock;
+  struct block *list;
+  int cnt;
+} zpool;
+
 /* Physical memory */
 struct {
   struct spinlock lock;
-  struct block *freelist;
+  /* buddy free lists, free_area[i] holds blocks of 2^i pages, 
+     protected by lock */
+  struct block *free_area[KMALLOC_MAX_ORDER+1];
+  uint8_t pg_order[NPAGES];
+  uint64_t nr_free;            // pages on the buddy lists
+  uint64_t min_free;           // low-water mark of nr_free
+  struct pcache pcache[NCORE]; // per-core caches in front of the buddy lists
 } memory;
 
+/* 
+Extra references to each page beyond its first owner, for pages shared 
+copy-on-write. A page with pg_ref 0 has a single owner, so kmalloc() 
+never has to initialize it and kfree() returns it to the allocator. 
+Updated with atomics only.
+*/
+uint32_t pg_ref[NPAGES];
+
+/*
+    Binary buddy allocator:
+    A free block of order k covers 2^k pages and starts at a page index 
+    that is a multiple of 2^k. Its buddy is the other half of the order 
+    k+1 block containing it, at index (idx ^ 2^k). When a block is freed 
+    and its buddy is free with the same order, both are merged into one 
+    block of order k+1, repeatedly up to KMALLOC_MAX_ORDER.
+*/
+
+/* Unlink b from free_area[order]. memory.lock must be held. */
+static void area_del(struct block *b, int order){
+    if (b->prev) b->prev->next = b->next;
+    else memory.free_area[order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    memory.pg_order[PAGE_IDX(b)] = 0;
+}
+
+/* Push b to free_area[order]. memory.lock must be held. */
+static void area_add(struct block *b, int order){
+    b->prev = 0;
+    b->next = memory.free_area[order];
+    if (b->next) b->next->prev = b;
+    memory.free_area[order] = b;
+    memory.pg_order[PAGE_IDX(b)] = PG_FREE | order;
+}
+
+/* Take a block of 2^order pages, splitting a larger one if needed. 
+memory.lock must be held. */
+static struct block* buddy_alloc(int order){
+    int o = order;
+    struct block *b;
+
+    while (o <= KMALLOC_MAX_ORDER && !memory.free_area[o])
+        o++;
+    if (o > KMALLOC_MAX_ORDER)
+        return 0;
+
+    b = memory.free_area[o];
+    area_del(b, o);
+    memory.nr_free -= 1UL << order;
+    if (memory.nr_free < memory.min_free)
+        memory.min_free = memory.nr_free;
+    /* Hand the upper halves back until the block has the right size */
+    while (o > order){
+        o--;
+        area_add(IDX_PAGE(PAGE_IDX(b) + (1UL << o)), o);
+    }
+    return b;
+}
+
+/* Return a block of 2^order pages, coalescing with free buddies. 
+memory.lock must be held. */
+static void buddy_free(struct block *b, int order){
+    uint64_t idx = PAGE_IDX(b);
+
+    memory.nr_free += 1UL << order;
+    while (order < KMALLOC_MAX_ORDER){
+        uint64_t buddy = idx ^ (1UL << order);
+        if (memory.pg_order[buddy] != (PG_FREE | order))
+            break;
+        area_del(IDX_PAGE(buddy), order);
+        idx &= ~(1UL << order);
+        order++;
+    }
+    area_add(IDX_PAGE(idx), order);
+}
+
+/* Add pages [start, stop) to the buddy lists as the largest naturally 
+aligned blocks that fit, touching only the first page of each block. 
+memory.lock must be held. */
+static uint64_t buddy_add_range(uint64_t start, uint64_t stop){
+    uint64_t idx = PAGE_IDX(start), last = PAGE_IDX(stop);
+    uint64_t blocks = 0;
+
+    while (idx < last){
+        int order = KMALLOC_MAX_ORDER;
+        while (order > 0 && 
+               ((idx & ((1UL << order) - 1)) || idx + (1UL << order) > last))
+            order--;
+        area_add(IDX_PAGE(idx), order);
+        idx += 1UL << order;
+        memory.nr_free += 1UL << order;
+        blocks++;
+    }
+    return blocks;
+}
+
 /* Initialize memory struct and spinlock */
 void pm_init(){
     printk("+------------------------------------------+\n");
     printk("|                  pm_init                 |\n");
     printk("+------------------------------------------+\n");
+    /* Still running on physical addresses, so mtime can be read directly */
+    uint64_t t0 = *(volatile uint64_t*)CLINT_MTIME;
+    uint64_t blocks;
+
     spinlock_init(&memory.lock);
-    memory.freelist = 0;
-    for (char* i = free_start; i + PSIZE < end; i+=PSIZE){
-        kfree((void*) i);
-    }
+    spinlock_init(&zpool.lock);
+    for (int i = 0; i <= KMALLOC_MAX_ORDER; i++)
+        memory.free_area[i] = 0;
+    /* Hand the whole free range over at once instead of page by page */
+    acquire_spinlock(&memory.lock);
+    blocks = buddy_add_range((uint64_t)free_start, (uint64_t)end);
+    memory.min_free = memory.nr_free;
+    release_spinlock(&memory.lock);
+
+    uint64_t t1 = *(volatile uint64_t*)CLINT_MTIME;
     printk("[kmalloc.c] pm_init: free_start@%p to end@%p\n", free_start, end);
+    printk("[kmalloc.c] pm_init: %d pages in %d blocks, took %d us\n",
+           (int)(((uint64_t)end - (uint64_t)free_start) / PSIZE), (int)blocks,
+           (int)((t1 - t0) * 1000000 / MTIME_FREQ));
+}
+
+/* Move up to PCACHE_BATCH pages from the buddy lists into pc.
+Caller must have interrupts off. */
+static void pcache_refill(struct pcache *pc){
+    acquire_spinlock(&memory.lock);
+    for (int i = 0; i < PCACHE_BATCH; i++){
+        struct block *b = buddy_alloc(0);
+        if (!b) break;
+        b->next = pc->list;
+        pc->list = b;
+        pc->cnt++;
+    }
+    release_spinlock(&memory.lock);
+}
+
+/* Give PCACHE_BATCH pages of pc back to the buddy lists. The batch is 
+unlinked first so the lock is only taken once for the whole batch.
+Caller must have interrupts off. */
+static void pcache_drain(struct pcache *pc){
+    struct block *b = pc->list, *last = pc->list;
+    for (int i = 1; i < PCACHE_BATCH; i++)
+        last = last->next;
+    pc->list = last->next;
+    pc->cnt -= PCACHE_BATCH;
+    last->next = 0;
+
+    acquire_spinlock(&memory.lock);
+    while (b){
+        struct block *next = b->next;
+        buddy_free(b, 0);
+        b = next;
+    }
+    release_spinlock(&memory.lock);
 }
 
 /* 
@@ -63,31 +254,229 @@ return 0 if no available memory
 */
 void* kmalloc(){
     struct block *b = 0;
+    struct pcache *pc;
 
-    acquire_spinlock(&memory.lock);
-    if (memory.freelist){
-        b = memory.freelist;
-        memory.freelist = memory.freelist->next;  
+    /* Interrupts off keeps us on this core and keeps handlers on 
+    this core from touching the cache underneath us */
+    intr_push();
+    pc = &memory.pcache[get_coreid()];
+    if (!pc->cnt)
+        pcache_refill(pc);
+    if (pc->cnt){
+        b = pc->list;
+        pc->list = b->next;
+        pc->cnt--;
+        pc->allocs++;
+    } else {
+        pc->fails++;
     }
-    release_spinlock(&memory.lock);
+    intr_pop();
 
+#ifdef KMALLOC_POISON
     if (b) 
         memset((char*)b, 5, PSIZE);
+#endif
     // printk("[kmalloc.c] kmalloc: allocated at %p\n", (void*)b);
     return (void*)b;
 }
 
 /* Free a 4096 bytes physical page pointed by pa */
 void kfree(void *pa){
-    if (((uint64_t)pa % PSIZE) != 0 || (char *)pa < free_start || (char *)pa > end)
+    if (((uint64_t)pa % PSIZE) != 0 || (char *)pa < free_start || (char *)pa >= end)
         kerror(__FILE_NAME__,__LINE__,"kfree");
+    /* Shared page: only drop this owner's reference */
+    if (kpage_unshare(pa))
+        return;
+#ifdef KMALLOC_POISON
     memset(pa, 1, PSIZE);
+#endif
     struct block *b = (struct block *) pa;
+    struct pcache *pc;
+
+    intr_push();
+    pc = &memory.pcache[get_coreid()];
+    b->next = pc->list;
+    pc->list = b;
+    pc->cnt++;
+    pc->frees++;
+    if (pc->cnt > PCACHE_HIGH)
+        pcache_drain(pc);
+    intr_pop();
+}
+
+/* Free n 4096 bytes pages at once: interrupts are turned off and the 
+core cache looked up only once for the whole batch */
+void kfree_bulk(void **pages, int n){
+    struct pcache *pc;
+
+    intr_push();
+    pc = &memory.pcache[get_coreid()];
+    for (int i = 0; i < n; i++){
+        void *pa = pages[i];
+        if (((uint64_t)pa % PSIZE) != 0 || (char *)pa < free_start || (char *)pa >= end)
+            kerror(__FILE_NAME__,__LINE__,"kfree_bulk");
+        if (kpage_unshare(pa))
+            continue;
+#ifdef KMALLOC_POISON
+        memset(pa, 1, PSIZE);
+#endif
+        struct block *b = (struct block *) pa;
+        b->next = pc->list;
+        pc->list = b;
+        pc->cnt++;
+        pc->frees++;
+        if (pc->cnt > PCACHE_HIGH)
+            pcache_drain(pc);
+    }
+    intr_pop();
+}
+
+/* Add a reference to the page pa, which gets one more owner */
+void kpage_share(void *pa){
+    __sync_fetch_and_add(&pg_ref[PAGE_IDX(pa)], 1);
+}
+
+/* 
+Drop one extra reference of the page pa
+return 1 if another owner still holds the page or
+return 0 if the caller was the last owner
+*/
+int kpage_unshare(void *pa){
+    uint32_t *ref = &pg_ref[PAGE_IDX(pa)];
+    uint32_t r;
+
+    do {
+        if ((r = *ref) == 0)
+            return 0;
+    } while (!__sync_bool_compare_and_swap(ref, r, r - 1));
+    return 1;
+}
+
+/* Number of owners of the page pa */
+int kpage_refs(void *pa){
+    return pg_ref[PAGE_IDX(pa)] + 1;
+}
+
+/*
+Allocate 2^order physically contiguous pages aligned to their size
+return valid PA if memory available or
+return 0 if no available memory
+*/
+void* kmalloc_pages(int order){
+    struct block *b;
+
+    if (order == 0)
+        return kmalloc();
+    if (order < 0 || order > KMALLOC_MAX_ORDER)
+        kerror(__FILE_NAME__,__LINE__,"kmalloc_pages: bad order");
+
+    acquire_spinlock(&memory.lock);
+    b = buddy_alloc(order);
+    release_spinlock(&memory.lock);
+
+    intr_push();
+    if (b) memory.pcache[get_coreid()].allocs++;
+    else   memory.pcache[get_coreid()].fails++;
+    intr_pop();
+
+#ifdef KMALLOC_POISON
+    if (b)
+        memset((char*)b, 5, PSIZE << order);
+#endif
+    return (void*)b;
+}
+
+/* Free 2^order pages pointed by pa, which came from kmalloc_pages(order) */
+void kfree_pages(void *pa, int order){
+    if (order == 0){
+        kfree(pa);
+        return;
+    }
+    if (order < 0 || order > KMALLOC_MAX_ORDER || 
+        ((uint64_t)pa % (PSIZE << order)) != 0 || 
+        (char *)pa < free_start || (char *)pa + (PSIZE << order) > end)
+        kerror(__FILE_NAME__,__LINE__,"kfree_pages");
+#ifdef KMALLOC_POISON
+    memset(pa, 1, PSIZE << order);
+#endif
 
     acquire_spinlock(&memory.lock);
-    b->next = memory.freelist;
-    memory.freelist = b;
+    buddy_free((struct block*)pa, order);
     release_spinlock(&memory.lock);
+
+    intr_push();
+    memory.pcache[get_coreid()].frees++;
+    intr_pop();
+}
+
+/*
+Allocate a zero-filled 4096 bytes physical page
+return valid PA if memory available or
+return 0 if no available memory
+*/
+void* kzalloc(){
+    struct block *b = 0;
+
+    acquire_spinlock(&zpool.lock);
+    if (zpool.list){
+        b = zpool.list;
+        zpool.list = b->next;
+        zpool.cnt--;
+    }
+    release_spinlock(&zpool.lock);
+
+    if (b){
+        b->next = 0;
+        return (void*)b;
+    }
+    /* Pool is dry, zero one on the spot */
+    if ((b = kmalloc()) != 0)
+        memset((char*)b, 0, PSIZE);
+    return (void*)b;
+}
+
+/* 
+Top up the zeroed page pool by one page, meant to be called from the 
+idle loop so that zeroing happens off the allocation path.
+return 1 if a page was added, 0 if the pool is full or memory is out
+*/
+int kzalloc_refill(){
+    struct block *b;
+
+    /* Racy peek, a stale value only costs one extra page or one 
+    missed round */
+    if (zpool.cnt >= ZPOOL_HIGH || (b = kmalloc()) == 0)
+        return 0;
+    memset((char*)b, 0, PSIZE);
+
+    acquire_spinlock(&zpool.lock);
+    b->next = zpool.list;
+    zpool.list = b;
+    zpool.cnt++;
+    release_spinlock(&zpool.lock);
+    return 1;
 }
 
+/* Print free page counts and per-core allocation counters. Per-core 
+numbers are read without locking and may be slightly stale. */
+void kmalloc_dump(){
+    uint64_t nr_free, min_free, cached = 0;
 
+    acquire_spinlock(&memory.lock);
+    nr_free = memory.nr_free;
+    min_free = memory.min_free;
+    release_spinlock(&memory.lock);
+
+    for (int i = 0; i < NCORE; i++)
+        cached += memory.pcache[i].cnt;
+
+    printk("[kmalloc.c] free pages: %d buddy (low-water %d), %d core-cached, %d zeroed\n",
+           (int)nr_free, (int)min_free, (int)cached, zpool.cnt);
+    for (int i = 0; i < NCORE; i++){
+        struct pcache *pc = &memory.pcache[i];
+        if (!pc->allocs && !pc->frees && !pc->fails)
+            continue;
+        printk("[kmalloc.c] core %d: alloc %d free %d fail %d cached %d\n",
+               i, (int)pc->allocs, (int)pc->frees, (int)pc->fails, pc->cnt);
+    }
+}
@@ -6,6 +6,7 @@
  * sequence.
  */
 #include "../include/kmalloc.h"
+#include "../include/slab.h"
 #include "../include/param.h"
 #include "../include/proc.h"
 #include "../include/riscv.h"
@@ -23,7 +24,9 @@
 #include "../include/bio.h"
 #include "../include/fs.h"
 #include "../include/console.h"
-
+#include "../include/ipi.h"
+#include "../include/sched.h"
+#include "../include/workqueue.h"
 volatile static int started = 0;
 extern ptb_t kernel_ptb;
 extern char etext[];
@@ -37,26 +40,34 @@ int main(){
         printk("\n");
         printk("Kernel is booting...\n");
         pm_init();
+        kmem_init();
         kernel_vm_init();
         proc_init();
+        sched_init();
+        workqueue_init();
         trap_init();
         plic_init();
+        ipi_init();
+        ipi_init_hart();
+        workqueue_init_hart();
         write_sstatus(read_sstatus()|1<<1);
-
-
         // binit();
         // iinit();
         // disk_init();
         // printk("Kernel is booting...\n");
-        // __sync_synchronize();
-        // started = 1;
+        __sync_synchronize();
+        started = 1;
         // printk("Ending...\n");
-    } 
-    // else {
-    //     while(started == 0);
-    //     __sync_synchronize();
-    //     printk("hart %d starting\n", get_coreid());
-    // }
-    for(;;);
+    } else {
+        while(started == 0);
+        __sync_synchronize();
+        kernel_vm_init_hart();
+        trap_init_hart();
+        ipi_init_hart();
+        workqueue_init_hart();
+        write_sstatus(read_sstatus() | SSTATUS_SIE);
+        printk("hart %d starting\n", get_coreid());
+    }
+    scheduler();
     return 0;
 };
\ No newline at end of file
@@ -13,13 +13,34 @@
 #include "../include/types.h"
 #include "../include/kerror.h"
 #include "../include/vm.h"
-
+#include "../include/ipi.h"
+#include "../include/sched.h"
+#include "../include/slab.h"
 pid_t current_pid = 1;
-struct spinlock pid_lock;
-
 core_t cores[NCORE];
-proc_t procs[NPROC];
 
+/* Process structures come from proc_cache on demand. Released ones go 
+to free_procs instead of back to the cache, so their kernel stack stays 
+mapped for the next user and a stale pointer from find_proc() still 
+points at a proc_t */
+static struct kmem_cache proc_cache;
+static struct spinlock free_lock;
+static proc_t *free_procs;
+
+/* Kernel stack virtual addresses, next is the top of the next unused slot. 
+  lock also serialises the kernel page table updates that map the stacks, 
+  so harts filling in the same intermediate table cannot lose a mapping */
+static struct {
+  struct spinlock lock;
+  uint64_t next;
+} kstack_va;
+/* Live processes hashed by pid */
+static struct pid_bucket {
+  struct spinlock lock;
+  proc_t *head;
+} pid_hash[PID_HASH];
+
+#define PID_BUCKET(pid) (&pid_hash[(pid) & (PID_HASH-1)])
 extern char trap[];
 extern ptb_t kernel_ptb;
 
@@ -47,12 +68,79 @@ get_myproc(void)
 
 /* Get next valid pid */
 pid_t next_pid(){
-  pid_t res = 0;
-  acquire_spinlock(&pid_lock);
-  res = current_pid;
-  current_pid++;
-  release_spinlock(&pid_lock);
-  return res;
+  return __sync_fetch_and_add(&current_pid, 1);
+}
+
+static void pid_hash_insert(proc_t* proc){
+  struct pid_bucket *b = PID_BUCKET(proc->pid);
+
+  acquire_spinlock(&b->lock);
+  proc->pid_next = b->head;
+  b->head = proc;
+  release_spinlock(&b->lock);
+}
+
+static void pid_hash_remove(proc_t* proc){
+  struct pid_bucket *b = PID_BUCKET(proc->pid);
+  proc_t **pp;
+
+  acquire_spinlock(&b->lock);
+  for (pp = &b->head; *pp; pp = &(*pp)->pid_next){
+    if (*pp == proc){
+      *pp = proc->pid_next;
+      break;
+    }
+  }
+  release_spinlock(&b->lock);
+}
+
+/* Look up a live process by pid. Return it with its lock held, or 0. 
+  The bucket lock is dropped before taking proc->lock (the insert side 
+  nests them the other way round), so the slot is checked again once 
+  locked in case it was released and reused in between. Process 
+  structures are never freed, only recycled, so the pointer stays valid. */
+proc_t* find_proc(pid_t pid){
+  struct pid_bucket *b = PID_BUCKET(pid);
+  proc_t *proc;
+
+  acquire_spinlock(&b->lock);
+  for (proc = b->head; proc; proc = proc->pid_next)
+    if (proc->pid == pid)
+      break;
+  release_spinlock(&b->lock);
+  if (proc == 0)
+    return 0;
+  acquire_spinlock(&proc->lock);
+  if (proc->pid != pid || proc->state == INITED){
+    release_spinlock(&proc->lock);
+    return 0;
+  }
+  return proc;
+}
+
+/* A fresh process structure, no kernel stack yet */
+static void proc_ctor(void *obj){
+  proc_t *proc = (proc_t*)obj;
+
+  memset(proc, 0, sizeof(proc_t));
+  spinlock_init(&proc->lock);
+  proc->state = INITED;
+  proc->fp_cpu = -1;
+  sched_proc_init(proc);
+}
+
+/* Reserve the virtual range of one kernel stack, return its lowest 
+  address or 0 once [KSTACK_BOTTOM, TRAP) is used up */
+static uint64_t kstack_va_alloc(){
+  uint64_t va = 0;
+
+  acquire_spinlock(&kstack_va.lock);
+  if (kstack_va.next - KSTACK_SLOT >= KSTACK_BOTTOM){
+    kstack_va.next -= KSTACK_SLOT;
+    va = kstack_va.next;
+  }
+  release_spinlock(&kstack_va.lock);
+  return va;
 }
 
 /* initialize proc structures */
@@ -60,31 +148,71 @@ void proc_init(){
   printk("+------------------------------------------+\n");
   printk("|               proc_init                  |\n");
   printk("+------------------------------------------+\n");
-  void *new_kstack = 0;
-
-  /* map kernel stack */
-  for (int i=0; i<NPROC; i++){
-    spinlock_init(&procs[i].lock);
-    procs[i].state  = INITED;
-    procs[i].kstack = GET_PROC_KSTACK(i); /* VA for the stack page */
-    if ((new_kstack = kmalloc()) == 0) kerror(__FILE_NAME__,__LINE__,"Error in proc_init kstack");
-    if(!map_pages(kernel_ptb, 
-              procs[i].kstack, 
-              PSIZE, 
-              (uint64_t)new_kstack, 
-              PTE_R|PTE_W|PTE_X, 
-              "kernel stacks")){
-                kerror(__FILE_NAME__,__LINE__,"Error in mapping Kernel stack");
-              }
+
+  kmem_cache_init(&proc_cache, "proc", sizeof(proc_t), proc_ctor);
+  spinlock_init(&free_lock);
+  free_procs = 0;
+  spinlock_init(&kstack_va.lock);
+  kstack_va.next = TRAP;
+  for (int i=0; i<PID_HASH; i++){
+    spinlock_init(&pid_hash[i].lock);
+    pid_hash[i].head = 0;
   }
 }
 
+/* Give proc a kernel stack the first time the structure is used. The 
+  stack stays mapped when proc is released, so reusing it costs nothing. 
+  A new stack is shot down on the other harts, so no spinlock may be 
+  held then. */
+int prep_kstack(proc_t* proc){
+  void *new_kstack;
+  struct tlb_batch b;
+  int ok;
+  if (proc->kstack_pa)
+    return 1;
+  if (proc->kstack == 0 && (proc->kstack = kstack_va_alloc()) == 0)
+    return 0;
+  if ((new_kstack = kmalloc_pages(KSTACK_ORDER)) == 0)
+    return 0;
+  acquire_spinlock(&kstack_va.lock);
+  ok = map_pages(kernel_ptb, 
+                 0, 
+                 proc->kstack,  
+                 PSIZE*KSTACK_PAGES, 
+                 (uint64_t)new_kstack, 
+                 PTE_R|PTE_W, 
+                 "kernel stack");
+  release_spinlock(&kstack_va.lock);
+  if (!ok){
+    kfree_pages(new_kstack, KSTACK_ORDER);
+    return 0;
+  }
+  /* map_pages() only fenced this hart, the stack may run on any other */
+  tlb_batch_init(&b, 0);
+  tlb_batch_add_range(&b, proc->kstack, proc->kstack + PSIZE*KSTACK_PAGES);
+  tlb_batch_flush(&b);
+  proc->kstack_pa = new_kstack;
+  return 1;
+}
+
+/* Free proc's whole address space and drop its TLB entries with a 
+  single flush */
+void proc_freepagetable(proc_t* proc){
+  uvm_free(proc->pagetable);
+  proc_flush_tlb(proc);
+}
+
+/* Release everything proc owns and put it back on the free list, 
+  proc->lock is held by the caller */
 void restore_proc(proc_t* proc){
   if(proc->trapframe) kfree((void*)proc->trapframe);
-  // if(proc->pagetable) proc_freepagetable(p->pagetable, p->sz); todo
+  if(proc->pagetable) proc_freepagetable(proc);
+  if(proc->pid) pid_hash_remove(proc);
   proc->state     = INITED;
   proc->trapframe = 0;
   proc->pagetable = 0;
+  proc->asid      = 0;
+  proc->cpumask   = 0;
   proc->name[0]   = 0;
   proc->parent    = 0;
   proc->killed    = 0;
@@ -92,6 +220,17 @@ void restore_proc(proc_t* proc){
   proc->chan      = 0;
   proc->pid       = 0;
   proc->sz        = 0;
+  proc->kfn       = 0;
+  proc->karg      = 0;
+  /* A new process starts with zeroed FP registers, and no core may 
+  think it still holds this structure's old ones */
+  proc->fp_cpu    = -1;
+  memset(&proc->fp, 0, sizeof(proc->fp));
+  sched_proc_init(proc);
+  acquire_spinlock(&free_lock);
+  proc->free_next = free_procs;
+  free_procs = proc;
+  release_spinlock(&free_lock);
 }
 
 int prep_trap_frame(proc_t* proc){
@@ -103,19 +242,20 @@ int prep_trap_frame(proc_t* proc){
 }
 
 int prep_page_table(proc_t* proc){
-  ptb_t pagetable = (ptb_t)kmalloc();
+  ptb_t pagetable = (ptb_t)kzalloc();
   if(pagetable == 0) return 0;
-  memset(pagetable, 0, PSIZE);
+  /* Owned by proc from here on, restore_proc() frees it on failure */
+  proc->pagetable = pagetable;
 
-  if (!map_pages(pagetable, TRAP, PSIZE, (uint64_t)trap, PTE_R | PTE_X, "utrap")){
+  if (!map_pages(pagetable, proc->asid, TRAP, PSIZE, (uint64_t)trap, PTE_R | PTE_X, "utrap")){
     printk("prep_page_table error when mapping trap.\n");
     kerror(__FILE_NAME__,__LINE__,"Error prep_page_table");
-    // unmap_pages(pagetable, TRAP, PSIZE);
+    // unmap_pages(pagetable, proc->asid, TRAP, PSIZE);
     // TODO
     return 0;
   }
 
-  if (!map_pages(pagetable, TRAP_FRAME, PSIZE, (uint64_t) proc->trapframe, PTE_R | PTE_W, "utrap_frame")){
+  if (!map_pages(pagetable, proc->asid, TRAP_FRAME, PSIZE, (uint64_t) proc->trapframe, PTE_R | PTE_W, "utrap_frame")){
     printk("prep_page_table error when mapping utrap_frame.\n");
     kerror(__FILE_NAME__,__LINE__,"Error prep_page_table");
     // TODO
@@ -124,36 +264,136 @@ int prep_page_table(proc_t* proc){
   return 1;
 }
 
+/* Grow or shrink proc's user memory by n bytes. Growing only moves 
+  sz, pages are allocated by lazy_fault() on first touch. 
+  Return 1 on success or 0 if the new size is out of range */
+int grow_proc(proc_t* proc, long n){
+  uint64_t sz = proc->sz;
+
+  if (n > 0){
+    if (sz + n < sz || sz + n > MAXUVA) return 0;
+    proc->sz = sz + n;
+  } else if (n < 0){
+    struct tlb_batch b;
+    if ((uint64_t)-n > sz) return 0;
+    proc->sz = sz + n;
+    uvm_dealloc(proc->pagetable, sz, proc->sz);
+    /* Other cores that ran proc may still cache the freed pages */
+    tlb_batch_init(&b, proc);
+    tlb_batch_add_range(&b, ADDR_ROUND(proc->sz, PSIZE, 1), sz);
+    tlb_batch_flush(&b);
+  }
+  return 1;
+}
+
 /* Return an inited process structure for using, now it 
   should be empty */
-proc_t* get_new_proc(){
-  proc_t* proc = 0;
+/* Take a free process structure and give it a kernel stack and a pid, 
+  return it locked and PICKED or 0 */
+static proc_t* alloc_proc(){
+  proc_t* proc;
 
-  for (int i=0; i<NPROC; i++){
-    proc = procs + i;
+  acquire_spinlock(&free_lock);
+  if ((proc = free_procs) != 0)
+    free_procs = proc->free_next;
+  release_spinlock(&free_lock);
+  if (proc == 0 && (proc = kmem_cache_alloc(&proc_cache)) == 0)
+    return 0;
+  /* A structure without a stack never ran, so it is set up before the 
+  lock is taken. One with a stack returns at once, its last owner may 
+  still be switching off that stack until we hold the lock. */
+  if(!prep_kstack(proc)) {
     acquire_spinlock(&proc->lock);
-    if (proc->state == INITED){ // return this
-      /* prepare trap frame and page table */
-      if(!prep_trap_frame(proc) || !prep_page_table(proc)) {
-        restore_proc(proc);
-        release_spinlock(&proc->lock);
-        return 0;
-      }
-      memset(&proc->context, 0, sizeof(proc->context));
-      // proc->context.ra = (uint64_t)forkret;
-      proc->context.sp = proc->kstack + PSIZE;
-
-      proc->state = PICKED;
-      proc->pid = next_pid();
-      return proc;
-    } else {
-      release_spinlock(&proc->lock);
-    }
+    restore_proc(proc);
+    release_spinlock(&proc->lock);
+    return 0;
   }
-  return 0;
+  acquire_spinlock(&proc->lock);
+  memset(&proc->context, 0, sizeof(proc->context));
+  proc->context.sp = proc->kstack + PSIZE*KSTACK_PAGES;
+  proc->state = PICKED;
+  proc->pid = next_pid();
+  pid_hash_insert(proc);
+  return proc;
 }
 
-void start_proc(){
-  
+proc_t* get_new_proc(){
+  proc_t* proc;
+
+  if ((proc = alloc_proc()) == 0)
+    return 0;
+  /* prepare trap frame and page table */
+  if(!prep_trap_frame(proc) || !prep_page_table(proc)) {
+    restore_proc(proc);
+    release_spinlock(&proc->lock);
+    return 0;
+  }
+  // proc->context.ra = (uint64_t)forkret;
+  return proc;
+}
+
+/* First code a kernel thread runs. The scheduler switched here holding 
+  proc->lock, as sched() would have returned with it. */
+static void kthread_entry(){
+  proc_t *proc = get_myproc();
+
+  release_spinlock(&proc->lock);
+  proc->kfn(proc->karg);
+  kthread_exit();
+}
+
+/* Start fn(arg) as a kernel thread on the current core. It runs on its 
+  kernel stack in the kernel page table only, with no trap frame or user 
+  memory. A pinned thread is never stolen by another core. Return the 
+  thread or 0. */
+proc_t* kthread_create(void (*fn)(void*), void *arg, char *name, int pinned){
+  proc_t *proc;
+  int i;
+
+  if ((proc = alloc_proc()) == 0)
+    return 0;
+  proc->kfn = fn;
+  proc->karg = arg;
+  proc->pinned = pinned;
+  proc->context.ra = (uint64_t)kthread_entry;
+  for (i = 0; name[i] && i < sizeof(proc->name)-1; i++)
+    proc->name[i] = name[i];
+  proc->name[i] = 0;
+  start_proc(proc);
+  release_spinlock(&proc->lock);
+  return proc;
+}
+
+/* End the calling kernel thread. Its structure goes back on the free 
+  list right away; whoever takes it next blocks on proc->lock until 
+  sched() has switched off the stack. */
+void kthread_exit(){
+  proc_t *proc = get_myproc();
+
+  acquire_spinlock(&proc->lock);
+  restore_proc(proc);
+  sched();
+  kerror(__FILE_NAME__,__LINE__,"kthread_exit");
+}
+
+/* End the calling user process with status. Nothing waits for children 
+  yet, so it is parked as a zombie that keeps its memory and never runs 
+  again. */
+void proc_exit(int status){
+  proc_t *proc = get_myproc();
+
+  acquire_spinlock(&proc->lock);
+  proc->xstate = status;
+  proc->state = ZOMBIE;
+  sched();
+  kerror(__FILE_NAME__,__LINE__,"proc_exit: zombie ran");
+}
 
+/* Make a new process runnable on the current core, proc->lock must be  
+  held as get_new_proc() returns it */
+void start_proc(proc_t* proc){
+  if (!core_holding(&proc->lock) || proc->state != PICKED)
+    kerror(__FILE_NAME__,__LINE__,"start_proc");
+  proc->state = RUNNABLE;
+  rq_enqueue(get_coreid(), proc, ENQUEUE_NEW);
 }
\ No newline at end of file
@@ -0,0 +1,211 @@
+/*
+ * rbtree.c - Intrusive red-black tree
+ *
+ * Nodes live inside the structures they order, so inserting and erasing 
+ * never allocates. Ordering comes from a less() callback at insert time. 
+ * Equal keys go to the right, which keeps insertion order among them.
+ */
+#include "../include/rbtree.h"
+
+#define IS_RED(n) ((n) != 0 && (n)->color == RB_RED)
+
+void rb_init(struct rb_root *root){
+  root->node = 0;
+  root->leftmost = 0;
+}
+
+/* Put v where u was under u's parent, v may be 0 */
+static void transplant(struct rb_root *root, struct rb_node *u, struct rb_node *v){
+  if (u->parent == 0) root->node = v;
+  else if (u == u->parent->left) u->parent->left = v;
+  else u->parent->right = v;
+  if (v) v->parent = u->parent;
+}
+
+static void rotate_left(struct rb_root *root, struct rb_node *x){
+  struct rb_node *y = x->right;
+
+  x->right = y->left;
+  if (y->left) y->left->parent = x;
+  transplant(root, x, y);
+  y->left = x;
+  x->parent = y;
+}
+
+static void rotate_right(struct rb_root *root, struct rb_node *x){
+  struct rb_node *y = x->left;
+
+  x->left = y->right;
+  if (y->right) y->right->parent = x;
+  transplant(root, x, y);
+  y->right = x;
+  x->parent = y;
+}
+
+struct rb_node* rb_next(struct rb_node *node){
+  struct rb_node *p;
+
+  if (node->right){
+    for (node = node->right; node->left; node = node->left);
+    return node;
+  }
+  while ((p = node->parent) != 0 && node == p->right)
+    node = p;
+  return p;
+}
+
+void rb_insert(struct rb_root *root, struct rb_node *node, 
+               int (*less)(struct rb_node *a, struct rb_node *b)){
+  struct rb_node **link = &root->node, *parent = 0, *g, *u;
+  int leftmost = 1;
+
+  while (*link){
+    parent = *link;
+    if (less(node, parent)){
+      link = &parent->left;
+    } else {
+      link = &parent->right;
+      leftmost = 0;
+    }
+  }
+  node->parent = parent;
+  node->left = node->right = 0;
+  node->color = RB_RED;
+  *link = node;
+  if (leftmost) root->leftmost = node;
+
+  /* A red node may not have a red parent, recolor or rotate upwards */
+  while (IS_RED(parent = node->parent)){
+    g = parent->parent;
+    if (parent == g->left){
+      u = g->right;
+      if (IS_RED(u)){
+        parent->color = u->color = RB_BLACK;
+        g->color = RB_RED;
+        node = g;
+        continue;
+      }
+      if (node == parent->right){
+        rotate_left(root, parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->color = RB_BLACK;
+      g->color = RB_RED;
+      rotate_right(root, g);
+    } else {
+      u = g->left;
+      if (IS_RED(u)){
+        parent->color = u->color = RB_BLACK;
+        g->color = RB_RED;
+        node = g;
+        continue;
+      }
+      if (node == parent->left){
+        rotate_right(root, parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->color = RB_BLACK;
+      g->color = RB_RED;
+      rotate_left(root, g);
+    }
+  }
+  root->node->color = RB_BLACK;
+}
+
+/* x (possibly 0) under parent xp carries one black too few */
+static void erase_fixup(struct rb_root *root, struct rb_node *x, struct rb_node *xp){
+  struct rb_node *w;
+
+  while (x != root->node && !IS_RED(x)){
+    if (x == xp->left){
+      w = xp->right;
+      if (IS_RED(w)){
+        w->color = RB_BLACK;
+        xp->color = RB_RED;
+        rotate_left(root, xp);
+        w = xp->right;
+      }
+      if (!IS_RED(w->left) && !IS_RED(w->right)){
+        w->color = RB_RED;
+        x = xp;
+        xp = x->parent;
+        continue;
+      }
+      if (!IS_RED(w->right)){
+        w->left->color = RB_BLACK;
+        w->color = RB_RED;
+        rotate_right(root, w);
+        w = xp->right;
+      }
+      w->color = xp->color;
+      xp->color = RB_BLACK;
+      w->right->color = RB_BLACK;
+      rotate_left(root, xp);
+    } else {
+      w = xp->left;
+      if (IS_RED(w)){
+        w->color = RB_BLACK;
+        xp->color = RB_RED;
+        rotate_right(root, xp);
+        w = xp->left;
+      }
+      if (!IS_RED(w->left) && !IS_RED(w->right)){
+        w->color = RB_RED;
+        x = xp;
+        xp = x->parent;
+        continue;
+      }
+      if (!IS_RED(w->left)){
+        w->right->color = RB_BLACK;
+        w->color = RB_RED;
+        rotate_left(root, w);
+        w = xp->left;
+      }
+      w->color = xp->color;
+      xp->color = RB_BLACK;
+      w->left->color = RB_BLACK;
+      rotate_right(root, xp);
+    }
+    x = root->node;
+  }
+  if (x) x->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *z){
+  struct rb_node *x, *xp, *y = z;
+  int y_color = z->color;
+
+  if (root->leftmost == z)
+    root->leftmost = rb_next(z);
+
+  if (z->left == 0){
+    x = z->right;
+    xp = z->parent;
+    transplant(root, z, x);
+  } else if (z->right == 0){
+    x = z->left;
+    xp = z->parent;
+    transplant(root, z, x);
+  } else {
+    /* Two children: z's successor y takes z's place */
+    for (y = z->right; y->left; y = y->left);
+    y_color = y->color;
+    x = y->right;
+    if (y->parent == z){
+      xp = y;
+    } else {
+      xp = y->parent;
+      transplant(root, y, x);
+      y->right = z->right;
+      y->right->parent = y;
+    }
+    transplant(root, z, y);
+    y->left = z->left;
+    y->left->parent = y;
+    y->color = z->color;
+  }
+  if (y_color == RB_BLACK)
+    erase_fixup(root, x, xp);
+}
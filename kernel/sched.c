@@ -0,0 +1,419 @@
+/*
+ * sched.c - Per-core run queues and the scheduler loop
+ *
+ * Every core owns a queue of RUNNABLE processes. Processes are queued on 
+ * the core that makes them runnable and picked by that core, so the hot 
+ * path only touches the local queue lock. A core with an empty queue 
+ * steals from the core with the longest queue before going idle. The 
+ * order within a queue is up to the scheduling classes (sched_fair.c).
+ */
+#include "../include/sched.h"
+#include "../include/proc.h"
+#include "../include/riscv.h"
+#include "../include/param.h"
+#include "../include/spinlock.h"
+#include "../include/kmalloc.h"
+#include "../include/kerror.h"
+#include "../include/timer.h"
+#include "../include/ipi.h"
+
+/* Sleeping processes, hashed by the channel they sleep on. A wakeup only 
+walks the one bucket its channel falls in */
+#define WAIT_HASH 64
+static struct waitq {
+  struct spinlock lock;
+  proc_t *head;
+} __attribute__((aligned(64))) waitqs[WAIT_HASH];
+
+/* Fibonacci hashing, the top 6 bits pick one of the 64 buckets */
+#define WAITQ(chan) (&waitqs[((uint64_t)(chan) * 0x9E3779B97F4A7C15UL) >> 58])
+
+void sched_init(){
+  for (int i = 0; i < NCORE; i++){
+    spinlock_init(&cores[i].rq.lock);
+    cores[i].rq.nr = 0;
+    cores[i].rq.nr_pinned = 0;
+    dl_rq_init(&cores[i].rq.dl);
+    cfs_rq_init(&cores[i].rq.cfs);
+  }
+  for (int i = 0; i < WAIT_HASH; i++){
+    spinlock_init(&waitqs[i].lock);
+    waitqs[i].head = 0;
+  }
+}
+
+/* Wake one core parked in wfi, other than self */
+static void kick_idle(int self){
+  for (int i = 0; i < NCORE; i++){
+    if (i != self && cores[i].idle){
+      ipi_send(i);
+      return;
+    }
+  }
+}
+
+/* Scheduling state of a new or recycled process structure */
+void sched_proc_init(proc_t* proc){
+  /* A recycled deadline process gives its bandwidth back */
+  if (proc->sclass == &dl_sched_class)
+    dl_release(proc);
+  proc->sclass   = &fair_sched_class;
+  proc->on_rq    = 0;
+  proc->pinned   = 0;
+  proc->nice     = 0;
+  proc->weight   = NICE_0_LOAD;
+  proc->vruntime = 0;
+  proc->sum_exec = 0;
+  proc->cpu      = 0;
+}
+
+/* Queue proc on core coreid. flags tell the class why (ENQUEUE_*) */
+void rq_enqueue(int coreid, proc_t* proc, int flags){
+  struct runqueue *rq = &cores[coreid].rq;
+  proc_t *running = cores[coreid].proc;
+  int waiting;
+
+  acquire_spinlock(&rq->lock);
+  /* yield(): charge the time just run before proc gets its new place */
+  if (running == proc)
+    proc->sclass->update(rq, proc);
+  proc->cpu = coreid;
+  proc->on_rq = 1;
+  if (proc->sclass->enqueue(rq, proc, flags)){
+    rq->nr++;
+    if (PROC_PINNED(proc)) rq->nr_pinned++;
+  }
+  waiting = rq->nr > 1 || (rq->nr && running != 0 && running != proc);
+  release_spinlock(&rq->lock);
+  /* Pairs with the barrier in idle(): either we see the idle flag or 
+  the idle core sees our nr */
+  __sync_synchronize();
+  if (coreid != get_coreid() && cores[coreid].idle)
+    ipi_send(coreid);      // queued on a parked core, wake it up
+  else if (coreid != get_coreid() && cores[coreid].need_resched)
+    ipi_send(coreid);      // preempts the core's process, make it look now
+  else if (waiting)
+    kick_idle(coreid);     // has to wait here, let an idle core steal it
+}
+
+/* Take the next process to run off core coreid's run queue, asking the 
+  classes in priority order. A stealing core skips pinned classes and 
+  pinned processes.  
+  0 if there is nothing to take */
+proc_t* rq_dequeue(int coreid, int steal){
+  struct runqueue *rq = &cores[coreid].rq;
+  const struct sched_class *class;
+  proc_t *proc = 0;
+
+  /* Unlocked peek, an empty queue costs no lock traffic */
+  if (rq->nr == 0)
+    return 0;
+  acquire_spinlock(&rq->lock);
+  for (class = sched_class_highest; class; class = class->next)
+    if ((!steal || !class->pinned) && (proc = class->pick(rq, steal)) != 0)
+      break;
+  if (proc){
+    proc->on_rq = 0;
+    rq->nr--;
+    if (PROC_PINNED(proc)) rq->nr_pinned--;
+  }
+  release_spinlock(&rq->lock);
+  return proc;
+}
+
+/* Anything core self could pick or steal */
+static int rq_waiting(int self){
+  if (cores[self].rq.nr)
+    return 1;
+  for (int i = 0; i < NCORE; i++)
+    if (cores[i].rq.nr > cores[i].rq.nr_pinned)
+      return 1;
+  return 0;
+}
+
+/* 
+Park the core until an interrupt arrives. Ticks stop while idle, 
+only requested timer events and IPIs wake the core. SIE is off across 
+the last queue check so a kick between the check and wfi still ends 
+the wfi, the interrupt is taken once SIE is back on.
+*/
+static void idle(int id){
+  intr_off();
+  cores[id].idle = 1;
+  __sync_synchronize();
+  timer_tickless();
+  if (!rq_waiting(id))
+    wfi();
+  cores[id].idle = 0;
+  intr_on();
+}
+
+/* Take a process from the core with the longest run queue */
+static proc_t* rq_steal(int self){
+  int busiest = -1, most = 0;
+  proc_t *proc;
+
+  for (int i = 0; i < NCORE; i++){
+    int n = cores[i].rq.nr - cores[i].rq.nr_pinned;
+    if (i != self && n > most){
+      most = n;
+      busiest = i;
+    }
+  }
+  if (busiest < 0 || (proc = rq_dequeue(busiest, 1)) == 0)
+    return 0;
+  /* The new core's accounting is only consistent under its own lock */
+  acquire_spinlock(&cores[self].rq.lock);
+  proc->sclass->migrate(&cores[busiest].rq, &cores[self].rq, proc);
+  proc->cpu = self;
+  release_spinlock(&cores[self].rq.lock);
+  return proc;
+}
+
+/* 
+Per-core scheduler loop, never returns. Picks a process from the local 
+queue, or steals one, and switches to it. The process switches back by 
+calling sched(). With nothing to run, the core does idle work instead.
+*/
+void scheduler(){
+  int id = get_coreid();
+  core_t *c = &cores[id];
+  proc_t *p;
+
+  c->proc = 0;
+  for(;;){
+    /* Let devices interrupt, a wakeup may queue work here */
+    intr_on();
+
+    if ((p = rq_dequeue(id, 0)) == 0 && (p = rq_steal(id)) == 0){
+      /* Idle: zero pages ahead of time for kzalloc(), then sleep */
+      if (!kzalloc_refill())
+        idle(id);
+      continue;
+    }
+    timer_periodic();
+
+    /* The previous core may still be switching away from p, its 
+    scheduler holds p->lock until swtch() is done */
+    acquire_spinlock(&p->lock);
+    if (p->state == RUNNABLE){
+      p->state = RUNNING;
+      p->cpu = id;
+      c->proc = p;
+      c->need_resched = 0;
+      fp_switch_in(p);
+      swtch(&c->context, &p->context);
+      /* p is back in sched(), with p->lock held */
+      c->proc = 0;
+    }
+    release_spinlock(&p->lock);
+  }
+}
+
+/* 
+Switch from the current process back to this core's scheduler. The 
+caller holds p->lock and nothing else, and has already changed 
+p->state. prev_int_state belongs to this kernel thread rather than to 
+the core, so it is saved and restored around the switch.
+*/
+void sched(){
+  core_t *c = get_mycore();
+  proc_t *p = c->proc;
+  int prev_int_state;
+
+  if (!core_holding(&p->lock))
+    kerror(__FILE_NAME__,__LINE__,"sched: p->lock not held");
+  if (c->disable_cnt != 1)
+    kerror(__FILE_NAME__,__LINE__,"sched: locks held");
+  if (c->preempt_cnt)
+    kerror(__FILE_NAME__,__LINE__,"sched: preemption disabled");
+  if (p->state == RUNNING)
+    kerror(__FILE_NAME__,__LINE__,"sched: running");
+  if (read_sstatus() & SSTATUS_SIE)
+    kerror(__FILE_NAME__,__LINE__,"sched: interruptible");
+
+  /* Not requeued (sleeping), charge the time run so far. A requeued p 
+  was charged by rq_enqueue() already, an exited one is reset. */
+  if (!p->on_rq && p->state != INITED){
+    acquire_spinlock(&c->rq.lock);
+    p->sclass->update(&c->rq, p);
+    release_spinlock(&c->rq.lock);
+  }
+  prev_int_state = c->prev_int_state;
+  fp_switch_out(p);
+  swtch(&p->context, &c->context);
+  /* May resume on another core */
+  get_mycore()->prev_int_state = prev_int_state;
+}
+
+/* Per-tick work of this core, called from clock_isr(): class timers, 
+  then accounting for the running process. Classes set need_resched when 
+  it is time for a switch. The timer keeps only the earliest event, so 
+  both hooks also re-request the events they still wait for. */
+void sched_tick(){
+  const struct sched_class *class;
+  struct runqueue *rq;
+  core_t *c;
+  proc_t *p;
+  int n;
+
+  intr_push();
+  c = get_mycore();
+  rq = &c->rq;
+  acquire_spinlock(&rq->lock);
+  for (class = sched_class_highest; class; class = class->next){
+    if (class->timer && (n = class->timer(rq)) > 0){
+      rq->nr += n;
+      if (class->pinned) rq->nr_pinned += n;
+    }
+  }
+  if ((p = c->proc) != 0)
+    p->sclass->tick(rq, p);
+  release_spinlock(&rq->lock);
+  intr_pop();
+}
+
+/* 
+Lazy FP. A process runs with sstatus.FS Off until it first touches an 
+FP register, which traps to fp_trap(). Processes that never use FP and 
+switches between them never save or load FP registers.
+*/
+
+/* Save proc's FP registers if it changed them, and turn FP off so the 
+  scheduler and the next process start without FP access */
+void fp_switch_out(proc_t* proc){
+  uint64_t sstatus = read_sstatus();
+
+  if ((sstatus & SSTATUS_FS) == SSTATUS_FS_DIRTY)
+    fp_save(&proc->fp);
+  write_sstatus(sstatus & ~SSTATUS_FS);
+}
+
+/* If this core's FP registers still hold proc's state, nothing ran FP 
+  here since, so proc can use them as they are. Otherwise leave FP off 
+  until proc needs it. */
+void fp_switch_in(proc_t* proc){
+  int id = get_coreid();
+
+  if (cores[id].fpowner == proc && proc->fp_cpu == id)
+    write_sstatus((read_sstatus() & ~SSTATUS_FS) | SSTATUS_FS_CLEAN);
+}
+
+/* Illegal instruction with FS Off: load proc's FP state into this core 
+  and retry. Return 0 if the trap was not about FP being off. */
+int fp_trap(proc_t* proc){
+  uint64_t sstatus = read_sstatus();
+  int id;
+
+  if ((sstatus & SSTATUS_FS) != SSTATUS_FS_OFF)
+    return 0;
+  intr_push();
+  id = get_coreid();
+  write_sstatus(sstatus | SSTATUS_FS_CLEAN);
+  fp_restore(&proc->fp);
+  /* fld made it Dirty, the copy in proc->fp is still current */
+  write_sstatus((read_sstatus() & ~SSTATUS_FS) | SSTATUS_FS_CLEAN);
+  cores[id].fpowner = proc;
+  proc->fp_cpu = id;
+  intr_pop();
+  return 1;
+}
+
+/* 
+Preempt the current process, called from the preemption points in 
+intr_pop() and kernel_trap() once need_resched is set. Interrupts stay 
+off until p->lock is held, so the intr_pop() inside cannot recurse 
+into here. The scheduler clears need_resched when it switches.
+*/
+void preempt_schedule(){
+  core_t *c;
+  proc_t *p;
+
+  intr_push();
+  c = get_mycore();
+  if ((p = c->proc) == 0 || c->preempt_cnt){
+    intr_pop();
+    return;
+  }
+  acquire_spinlock(&p->lock);
+  intr_pop();
+  if (p->state == RUNNING){
+    p->state = RUNNABLE;
+    rq_enqueue(get_coreid(), p, 0);
+    sched();
+  }
+  release_spinlock(&p->lock);
+}
+
+/* Give up the CPU for one round, the process stays on this core */
+void yield(){
+  proc_t *p = get_myproc();
+
+  acquire_spinlock(&p->lock);
+  p->state = RUNNABLE;
+  rq_enqueue(get_coreid(), p, 0);
+  sched();
+  release_spinlock(&p->lock);
+}
+
+/* 
+Atomically release lk and sleep on chan, reacquire lk when woken. 
+The process is on chan's wait queue before lk is dropped, and a waker 
+needs p->lock to make it runnable, which is only released once sched() 
+has switched away, so no wakeup is lost in between.
+*/
+void sleep(void *chan, struct spinlock *lk){
+  proc_t *p = get_myproc();
+  struct waitq *q = WAITQ(chan);
+
+  acquire_spinlock(&p->lock);
+  acquire_spinlock(&q->lock);
+  p->chan = chan;
+  p->state = SLEEPING;
+  p->wait_next = q->head;
+  q->head = p;
+  release_spinlock(&q->lock);
+  release_spinlock(lk);
+
+  sched();
+
+  p->chan = 0;
+  release_spinlock(&p->lock);
+  acquire_spinlock(lk);
+}
+
+/* 
+Wake every process sleeping on chan. Must be called with the lock the 
+sleepers passed to sleep(), which is also what makes the unlocked 
+empty-bucket check safe. Waiters are unlinked under the bucket lock and 
+made runnable after it is dropped, since sleep() nests the locks the 
+other way round. Each goes back to the core it last ran on.
+*/
+void wakeup(void *chan){
+  struct waitq *q = WAITQ(chan);
+  proc_t **pp, *p, *woken = 0;
+
+  if (q->head == 0)
+    return;
+  acquire_spinlock(&q->lock);
+  for (pp = &q->head; (p = *pp) != 0; ){
+    if (p->chan == chan){
+      *pp = p->wait_next;
+      p->wait_next = woken;
+      woken = p;
+    } else {
+      pp = &p->wait_next;
+    }
+  }
+  release_spinlock(&q->lock);
+
+  while ((p = woken) != 0){
+    woken = p->wait_next;
+    acquire_spinlock(&p->lock);
+    if (p->state == SLEEPING && p->chan == chan){
+      p->state = RUNNABLE;
+      rq_enqueue(p->cpu, p, ENQUEUE_WAKEUP);
+    }
+    release_spinlock(&p->lock);
+  }
+}
@@ -0,0 +1,225 @@
+/*
+ * sched_dl.c - Earliest deadline first scheduling class
+ *
+ * A deadline process reserves runtime every period and must get it 
+ * before deadline (relative to the start of each period). The class sits 
+ * above the fair class: while a deadline process is pickable on a core, 
+ * fair processes there wait. Among deadline processes the earliest 
+ * absolute deadline runs first.
+ *
+ * Reservations are enforced as a constant bandwidth server: a process 
+ * that used up its runtime is throttled until its deadline, then gets 
+ * a fresh budget and the next deadline. Throttled processes wake through 
+ * timer_request(), i.e. mtimecmp, not through periodic ticks. Admission 
+ * keeps the reserved bandwidth of each hart at or below DL_BW_MAX, and 
+ * deadline processes stay on the hart that admitted them.
+ */
+#include "../include/sched.h"
+#include "../include/proc.h"
+#include "../include/rbtree.h"
+#include "../include/timer.h"
+#include "../include/spinlock.h"
+#include "../include/ipi.h"
+
+#define NODE_PROC(node) rb_entry(node, proc_t, rb)
+/* mtime values wrap, compare their difference */
+#define TIME_BEFORE(a, b) ((long)((a) - (b)) < 0)
+
+#define DL_BW(runtime, period) (((runtime) << DL_BW_SHIFT) / (period))
+
+void dl_rq_init(struct dl_rq *dl){
+  rb_init(&dl->tasks);
+  dl->throttled = 0;
+  dl->bw = 0;
+}
+
+static int deadline_less(struct rb_node *a, struct rb_node *b){
+  return TIME_BEFORE(NODE_PROC(a)->deadline, NODE_PROC(b)->deadline);
+}
+
+/* Start a new period: full budget, deadline counted from now */
+static void dl_new_period(proc_t *proc, uint64_t now){
+  proc->deadline = now + proc->dl_deadline;
+  proc->runtime_left = proc->dl_runtime;
+  proc->dl_throttled = 0;
+}
+
+/* Preempt the running process if proc should run before it */
+static void dl_check_preempt(struct runqueue *rq, proc_t *proc){
+  core_t *c = RQ_CORE(rq);
+  proc_t *curr = c->proc;
+
+  if (curr && curr != proc && (curr->sclass != &dl_sched_class || 
+      TIME_BEFORE(proc->deadline, curr->deadline)))
+    c->need_resched = 1;
+}
+
+static int dl_enqueue(struct runqueue *rq, proc_t *proc, int flags){
+  uint64_t now = timer_now();
+
+  /* Waking up: keep the current deadline only if the budget left still 
+  fits in the time left at the reserved rate, otherwise start afresh. 
+  A throttled process stays throttled until its deadline. */
+  if (flags & (ENQUEUE_NEW | ENQUEUE_WAKEUP)){
+    if (!TIME_BEFORE(now, proc->deadline))
+      dl_new_period(proc, now);
+    else if (!proc->dl_throttled &&
+             (uint64_t)proc->runtime_left * proc->dl_period > 
+             (proc->deadline - now) * proc->dl_runtime)
+      dl_new_period(proc, now);
+  }
+
+  if (proc->dl_throttled){
+    proc->dl_next = rq->dl.throttled;
+    rq->dl.throttled = proc;
+    /* The core's own timer replenishes it, another core is told to 
+    arm one through its tick */
+    if (RQ_CORE(rq) == get_mycore())
+      timer_request(proc->deadline);
+    else
+      ipi_send(RQ_CORE(rq) - cores);
+    return 0;
+  }
+  rb_insert(&rq->dl.tasks, &proc->rb, deadline_less);
+  dl_check_preempt(rq, proc);
+  return 1;
+}
+
+/* Earliest deadline runs next, its budget end is armed as a timer event */
+static proc_t* dl_pick(struct runqueue *rq, int steal){
+  struct rb_node *left = rb_first(&rq->dl.tasks);
+  proc_t *proc;
+
+  if (left == 0)
+    return 0;
+  proc = NODE_PROC(left);
+  rb_erase(&rq->dl.tasks, left);
+  proc->exec_start = timer_now();
+  timer_request(proc->exec_start + proc->runtime_left);
+  return proc;
+}
+
+static void dl_update(struct runqueue *rq, proc_t *proc){
+  uint64_t now = timer_now(), delta = now - proc->exec_start;
+
+  proc->exec_start = now;
+  proc->sum_exec += delta;
+  proc->runtime_left -= delta;
+  if (proc->runtime_left <= 0){
+    proc->dl_throttled = 1;
+    RQ_CORE(rq)->need_resched = 1;
+  }
+}
+
+/* Like fair_tick(), the budget end is asked for again while some is left */
+static void dl_tick(struct runqueue *rq, proc_t *proc){
+  struct rb_node *left;
+
+  dl_update(rq, proc);
+  if (proc->runtime_left > 0)
+    timer_request(proc->exec_start + proc->runtime_left);
+  if ((left = rb_first(&rq->dl.tasks)) != 0 && 
+      TIME_BEFORE(NODE_PROC(left)->deadline, proc->deadline))
+    RQ_CORE(rq)->need_resched = 1;
+}
+
+static void dl_migrate(struct runqueue *from, struct runqueue *to, proc_t *proc){
+  /* pinned, never stolen */
+}
+
+/* Replenish throttled processes whose deadline has come and re-arm the 
+  timer for the earliest one still waiting */
+static int dl_timer(struct runqueue *rq){
+  uint64_t now = timer_now(), next = TIMER_NONE;
+  proc_t **pp, *proc;
+  int n = 0;
+
+  for (pp = &rq->dl.throttled; (proc = *pp) != 0; ){
+    if (TIME_BEFORE(now, proc->deadline)){
+      if (TIME_BEFORE(proc->deadline, next)) next = proc->deadline;
+      pp = &proc->dl_next;
+      continue;
+    }
+    *pp = proc->dl_next;
+    /* Next period's budget, less any overrun. Far behind, restart. */
+    proc->runtime_left += proc->dl_runtime;
+    proc->deadline += proc->dl_period;
+    if (proc->runtime_left <= 0 || TIME_BEFORE(proc->deadline, now))
+      dl_new_period(proc, now);
+    proc->dl_throttled = 0;
+    rb_insert(&rq->dl.tasks, &proc->rb, deadline_less);
+    dl_check_preempt(rq, proc);
+    n++;
+  }
+  if (next != TIMER_NONE)
+    timer_request(next);
+  return n;
+}
+
+const struct sched_class dl_sched_class = {
+  .next    = &fair_sched_class,
+  .pinned  = 1,
+  .enqueue = dl_enqueue,
+  .pick    = dl_pick,
+  .update  = dl_update,
+  .tick    = dl_tick,
+  .migrate = dl_migrate,
+  .timer   = dl_timer,
+};
+
+/* Give proc's reserved bandwidth back to its hart, proc is not queued */
+void dl_release(proc_t* proc){
+  struct runqueue *rq = &cores[proc->cpu].rq;
+
+  acquire_spinlock(&rq->lock);
+  rq->dl.bw -= DL_BW(proc->dl_runtime, proc->dl_period);
+  release_spinlock(&rq->lock);
+  proc->dl_runtime = proc->dl_deadline = proc->dl_period = 0;
+}
+
+/* 
+Make proc a deadline process that needs runtime every period, within 
+deadline of the period start (all in mtime units), or a fair process 
+again if runtime is 0. proc must not be queued: it is new or it is the 
+caller. Return 0 if the parameters are invalid or proc's hart cannot 
+take the extra bandwidth.
+*/
+int set_deadline(proc_t* proc, uint64_t runtime, uint64_t deadline, uint64_t period){
+  struct runqueue *rq;
+  uint64_t bw = 0, old = 0;
+  int ok = 0;
+
+  if (runtime && (runtime > deadline || deadline > period))
+    return 0;
+  if (runtime) bw = DL_BW(runtime, period);
+  acquire_spinlock(&proc->lock);
+  if (proc->on_rq)
+    goto out;
+  rq = &cores[proc->cpu].rq;
+  acquire_spinlock(&rq->lock);
+  if (proc->sclass == &dl_sched_class)
+    old = DL_BW(proc->dl_runtime, proc->dl_period);
+  if (rq->dl.bw - old + bw <= DL_BW_MAX){
+    /* A running proc is charged by its old class up to here */
+    if (RQ_CORE(rq)->proc == proc)
+      proc->sclass->update(rq, proc);
+    rq->dl.bw = rq->dl.bw - old + bw;
+    proc->dl_runtime  = runtime;
+    proc->dl_deadline = deadline;
+    proc->dl_period   = period;
+    if (runtime){
+      proc->sclass = &dl_sched_class;
+      dl_new_period(proc, timer_now());
+      if (RQ_CORE(rq)->proc == proc)
+        timer_request(proc->exec_start + runtime);
+    } else {
+      proc->sclass = &fair_sched_class;
+      proc->vruntime = rq->cfs.min_vruntime;
+    }
+    ok = 1;
+  }
+  release_spinlock(&rq->lock);
+out:
+  release_spinlock(&proc->lock);
+  return ok;
+}
@@ -0,0 +1,183 @@
+/*
+ * sched_fair.c - Fair share scheduling class
+ *
+ * Each process accumulates virtual runtime: the time it ran, scaled by 
+ * NICE_0_LOAD/weight, so heavier (lower nice) processes age slower. Each 
+ * core keeps its queued processes in a red-black tree ordered by 
+ * vruntime and always runs the leftmost one. Over time every process on 
+ * a core gets CPU in proportion to its weight.
+ *
+ * Times are in mtime units (MTIME_FREQ per second).
+ */
+#include "../include/sched.h"
+#include "../include/proc.h"
+#include "../include/rbtree.h"
+#include "../include/timer.h"
+#include "../include/spinlock.h"
+
+/* Period in which every queued process should run once */
+#define SCHED_LATENCY   (MTIME_FREQ / 1000 * 6)
+/* Shortest slice, however many processes share the core */
+#define SCHED_MIN_GRAN  (MTIME_FREQ / 10000 * 7)
+/* vruntime lead a process needs before it preempts the running one */
+#define SCHED_WAKEUP_GRAN (MTIME_FREQ / 1000)
+
+/* Load weight of nice -20..19, each step is about 10% more or less CPU */
+static const uint32_t nice_weight[40] = {
+  /* -20 */ 88761, 71755, 56483, 46273, 36291,
+  /* -15 */ 29154, 23254, 18705, 14949, 11916,
+  /* -10 */  9548,  7620,  6100,  4904,  3906,
+  /*  -5 */  3121,  2501,  1991,  1586,  1277,
+  /*   0 */  1024,   820,   655,   526,   423,
+  /*   5 */   335,   272,   215,   172,   137,
+  /*  10 */   110,    87,    70,    56,    45,
+  /*  15 */    36,    29,    23,    18,    15,
+};
+
+#define NODE_PROC(node) rb_entry(node, proc_t, rb)
+/* vruntimes wrap, compare their difference */
+#define VRUN_BEFORE(a, b) ((long)((a) - (b)) < 0)
+
+void cfs_rq_init(struct cfs_rq *cfs){
+  rb_init(&cfs->tasks);
+  cfs->min_vruntime = 0;
+  cfs->load = 0;
+}
+
+static int vruntime_less(struct rb_node *a, struct rb_node *b){
+  return VRUN_BEFORE(NODE_PROC(a)->vruntime, NODE_PROC(b)->vruntime);
+}
+
+/* Move min_vruntime up to the smallest vruntime on the core, curr is 
+  the running process or 0 */
+static void update_min_vruntime(struct cfs_rq *cfs, proc_t *curr){
+  struct rb_node *left = rb_first(&cfs->tasks);
+  uint64_t v;
+
+  if (curr) v = curr->vruntime;
+  else if (left) v = NODE_PROC(left)->vruntime;
+  else return;
+  if (curr && left && VRUN_BEFORE(NODE_PROC(left)->vruntime, v))
+    v = NODE_PROC(left)->vruntime;
+  if (VRUN_BEFORE(cfs->min_vruntime, v))
+    cfs->min_vruntime = v;
+}
+
+/* Slice of proc: its weight's share of SCHED_LATENCY among the queued */
+static uint64_t slice(struct cfs_rq *cfs, proc_t *proc){
+  uint64_t s = SCHED_LATENCY * proc->weight / (cfs->load + proc->weight);
+  return s < SCHED_MIN_GRAN ? SCHED_MIN_GRAN : s;
+}
+
+static void fair_update(struct runqueue *rq, proc_t *proc){
+  uint64_t now = timer_now(), delta = now - proc->exec_start;
+
+  proc->exec_start = now;
+  proc->sum_exec += delta;
+  proc->vruntime += delta * NICE_0_LOAD / proc->weight;
+  update_min_vruntime(&rq->cfs, proc);
+}
+
+static int fair_enqueue(struct runqueue *rq, proc_t *proc, int flags){
+  struct cfs_rq *cfs = &rq->cfs;
+  core_t *c = RQ_CORE(rq);
+  proc_t *curr = c->proc;
+
+  /* A new process starts level with the core. A sleeper keeps what it 
+  had, but at most half a latency period of credit, so it runs soon 
+  without being able to monopolize the core */
+  if (flags & ENQUEUE_NEW){
+    proc->vruntime = cfs->min_vruntime;
+  } else if (flags & ENQUEUE_WAKEUP){
+    uint64_t floor = cfs->min_vruntime - SCHED_LATENCY / 2;
+    if (VRUN_BEFORE(proc->vruntime, floor))
+      proc->vruntime = floor;
+  }
+  rb_insert(&cfs->tasks, &proc->rb, vruntime_less);
+  cfs->load += proc->weight;
+
+  /* Well behind the running process, take over the core soon */
+  if (curr && curr != proc && curr->sclass == &fair_sched_class &&
+      VRUN_BEFORE(proc->vruntime + SCHED_WAKEUP_GRAN, curr->vruntime))
+    c->need_resched = 1;
+  return 1;
+}
+
+/* The leftmost process runs next, or when stealing the leftmost one not 
+  pinned. Its slice is armed as a timer event, so it ends on time even 
+  when periodic ticks are coarse or off */
+static proc_t* fair_pick(struct runqueue *rq, int steal){
+  struct cfs_rq *cfs = &rq->cfs;
+  struct rb_node *left = rb_first(&cfs->tasks);
+  proc_t *proc;
+
+  while (steal && left && NODE_PROC(left)->pinned)
+    left = rb_next(left);
+  if (left == 0)
+    return 0;
+  proc = NODE_PROC(left);
+  rb_erase(&cfs->tasks, left);
+  cfs->load -= proc->weight;
+  update_min_vruntime(cfs, proc);
+
+  proc->exec_start = timer_now();
+  proc->slice_start = proc->sum_exec;
+  if (!rb_empty(&cfs->tasks))
+    timer_request(proc->exec_start + slice(cfs, proc));
+  return proc;
+}
+
+/* Preempt the running process once its slice is used up, or once the 
+  leftmost queued process is far enough behind it. Otherwise the slice 
+  end is asked for again, an earlier event may have displaced it. */
+static void fair_tick(struct runqueue *rq, proc_t *proc){
+  struct cfs_rq *cfs = &rq->cfs;
+  struct rb_node *left;
+  uint64_t used, s;
+
+  fair_update(rq, proc);
+  if ((left = rb_first(&cfs->tasks)) == 0)
+    return;
+  used = proc->sum_exec - proc->slice_start;
+  s = slice(cfs, proc);
+  if (used >= s ||
+      VRUN_BEFORE(NODE_PROC(left)->vruntime + SCHED_WAKEUP_GRAN, proc->vruntime))
+    RQ_CORE(rq)->need_resched = 1;
+  else
+    timer_request(proc->exec_start + s - used);
+}
+
+/* min_vruntime differs between cores, keep proc's lag relative to it */
+static void fair_migrate(struct runqueue *from, struct runqueue *to, proc_t *proc){
+  proc->vruntime = proc->vruntime - from->cfs.min_vruntime + to->cfs.min_vruntime;
+}
+
+const struct sched_class fair_sched_class = {
+  .next    = 0,
+  .pinned  = 0,
+  .enqueue = fair_enqueue,
+  .pick    = fair_pick,
+  .update  = fair_update,
+  .tick    = fair_tick,
+  .migrate = fair_migrate,
+  .timer   = 0,
+};
+
+/* Change proc's nice value, return 0 if it is out of range. Its weight 
+  in the queued load changes with it. */
+int set_nice(proc_t* proc, int nice){
+  struct runqueue *rq;
+
+  if (nice < -20 || nice > 19)
+    return 0;
+  acquire_spinlock(&proc->lock);
+  rq = &cores[proc->cpu].rq;
+  acquire_spinlock(&rq->lock);
+  if (proc->on_rq && proc->sclass == &fair_sched_class)
+    rq->cfs.load += nice_weight[nice + 20] - proc->weight;
+  proc->nice = nice;
+  proc->weight = nice_weight[nice + 20];
+  release_spinlock(&rq->lock);
+  release_spinlock(&proc->lock);
+  return 1;
+}
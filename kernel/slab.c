@@ -0,0 +1,237 @@
+/*
+ * slab.c - Slab object allocator
+ *
+ * Kernel objects smaller than a page are carved out of slabs, blocks of
+ * 2^order pages from kmalloc_pages(). Every cache keeps a small per-core
+ * array of free objects in front of its slabs so that most allocations
+ * and frees are a pointer pop/push with interrupts off and no lock.
+ */
+#include "../include/slab.h"
+#include "../include/kmalloc.h"
+#include "../include/riscv.h"
+#include "../include/types.h"
+#include "../include/spinlock.h"
+#include "../include/proc.h"
+#include "../include/kerror.h"
+
+/*
+    Slab layout (2^order pages, naturally aligned by the buddy allocator):
+        +------------------+ 0
+        |   struct slab    |
+        +------------------+ cache->offset (cache line aligned)
+        |     object 0     |
+        +------------------+ + cache->size
+        |     object 1     |
+        +------------------+
+        |       ...        |
+        +------------------+
+    Since slabs are aligned to their size, the slab owning an object is 
+    found by rounding the object address down.
+*/
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;          // cache->partial list
+  struct slab *prev;
+  void *freelist;             // free objects of this slab
+  uint32_t inuse;             // objects handed out (incl. core caches)
+};
+
+/* Slab header is padded to one cache line */
+#define SLAB_HDR 64
+/* Give up packing harder once the slab is this many pages */
+#define SLAB_MAX_ORDER 3
+
+#define SLAB_BYTES(cache) ((uint64_t)PSIZE << (cache)->order)
+#define SLAB_OF(cache, obj) ((struct slab*)((uint64_t)(obj) & ~(SLAB_BYTES(cache)-1)))
+
+/* Free objects are chained through their last word, so an object 
+built by the constructor keeps its first fields intact while free */
+#define OBJ_LINK(cache, obj) (*(void**)((char*)(obj) + (cache)->size - sizeof(void*)))
+
+/* Size classes for kmem_alloc(), 16 to KMEM_MAX_SIZE bytes */
+#define NSIZE_CLASS 7
+static struct kmem_cache size_caches[NSIZE_CLASS];
+static char *size_names[NSIZE_CLASS] = {
+  "kmem-16", "kmem-32", "kmem-64", "kmem-128", "kmem-256", "kmem-512", "kmem-1024"
+};
+
+static void cache_setup(struct kmem_cache *cache, char *name, uint32_t size, 
+                        void (*ctor)(void*), uint32_t order){
+  /* Room for the free link when a constructor owns the object body */
+  if (ctor) size += sizeof(void*);
+  size = (size + 7) & ~7;
+
+  cache->name     = name;
+  cache->size     = size;
+  cache->order    = order;
+  cache->offset   = SLAB_HDR;
+  cache->per_slab = (SLAB_BYTES(cache) - SLAB_HDR) / size;
+  cache->ctor     = ctor;
+  cache->partial  = 0;
+  cache->empty    = 0;
+  spinlock_init(&cache->lock);
+  for (int i = 0; i < NCORE; i++)
+    cache->cpu[i].cnt = 0;
+
+  if (cache->per_slab == 0)
+    kerror(__FILE_NAME__,__LINE__,"kmem cache object too large");
+}
+
+/* Initialize a cache for objects of size bytes. ctor, if any, is run 
+on every object when its slab is created, and objects must be freed 
+back in their constructed state. */
+void kmem_cache_init(struct kmem_cache *cache, char *name, uint32_t size, void (*ctor)(void*)){
+  uint32_t order = 0;
+  uint32_t full = ((ctor ? size + sizeof(void*) : size) + 7) & ~7;
+
+  /* Use bigger slabs until at most 1/8 of a slab is wasted */
+  while (order < SLAB_MAX_ORDER){
+    uint64_t bytes = (uint64_t)PSIZE << order;
+    uint64_t n = (bytes - SLAB_HDR) / full;
+    if (n && (bytes - SLAB_HDR - n*full) * 8 <= bytes) break;
+    order++;
+  }
+  cache_setup(cache, name, size, ctor, order);
+}
+
+/* Set up the kmem_alloc() size classes, must run after pm_init() */
+void kmem_init(){
+  uint32_t size = 16;
+  for (int i = 0; i < NSIZE_CLASS; i++, size <<= 1)
+    cache_setup(&size_caches[i], size_names[i], size, 0, 0);
+}
+
+static void slab_list_add(struct slab **head, struct slab *s){
+  s->prev = 0;
+  s->next = *head;
+  if (s->next) s->next->prev = s;
+  *head = s;
+}
+
+static void slab_list_del(struct slab **head, struct slab *s){
+  if (s->prev) s->prev->next = s->next;
+  else *head = s->next;
+  if (s->next) s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+/* Allocate and format a new slab. cache->lock must be held. */
+static struct slab* slab_new(struct kmem_cache *cache){
+  struct slab *s = (struct slab*)kmalloc_pages(cache->order);
+  if (s == 0) return 0;
+
+  s->cache    = cache;
+  s->next     = s->prev = 0;
+  s->freelist = 0;
+  s->inuse    = 0;
+  for (int i = cache->per_slab - 1; i >= 0; i--){
+    void *obj = (char*)s + cache->offset + (uint64_t)i * cache->size;
+    if (cache->ctor) cache->ctor(obj);
+    OBJ_LINK(cache, obj) = s->freelist;
+    s->freelist = obj;
+  }
+  return s;
+}
+
+/* Return obj to its slab. cache->lock must be held. */
+static void slab_put(struct kmem_cache *cache, void *obj){
+  struct slab *s = SLAB_OF(cache, obj);
+
+  if (s->cache != cache)
+    kerror(__FILE_NAME__,__LINE__,"kmem: object freed to the wrong cache");
+  /* A full slab is on no list, it becomes partial again */
+  if (s->freelist == 0)
+    slab_list_add(&cache->partial, s);
+  OBJ_LINK(cache, obj) = s->freelist;
+  s->freelist = obj;
+
+  if (--s->inuse == 0){
+    slab_list_del(&cache->partial, s);
+    /* Keep one empty slab around to absorb alloc/free ping-pong */
+    if (cache->empty == 0) cache->empty = s;
+    else kfree_pages(s, cache->order);
+  }
+}
+
+/* Pull up to KMEM_CPU_BATCH objects from the slabs into c. 
+Caller must have interrupts off. */
+static void cpu_refill(struct kmem_cache *cache, struct kmem_cpu *c){
+  acquire_spinlock(&cache->lock);
+  while (c->cnt < KMEM_CPU_BATCH){
+    struct slab *s = cache->partial;
+    if (s == 0){
+      if (cache->empty){
+        s = cache->empty;
+        cache->empty = 0;
+      } else if ((s = slab_new(cache)) == 0){
+        break;
+      }
+      slab_list_add(&cache->partial, s);
+    }
+    void *obj = s->freelist;
+    s->freelist = OBJ_LINK(cache, obj);
+    s->inuse++;
+    /* Slab is now full, take it off the partial list */
+    if (s->freelist == 0)
+      slab_list_del(&cache->partial, s);
+    c->objs[c->cnt++] = obj;
+  }
+  release_spinlock(&cache->lock);
+}
+
+/* Push KMEM_CPU_BATCH objects of c back to their slabs. 
+Caller must have interrupts off. */
+static void cpu_flush(struct kmem_cache *cache, struct kmem_cpu *c){
+  acquire_spinlock(&cache->lock);
+  for (int i = 0; i < KMEM_CPU_BATCH; i++)
+    slab_put(cache, c->objs[--c->cnt]);
+  release_spinlock(&cache->lock);
+}
+
+/* Allocate one object from cache, return 0 if out of memory */
+void* kmem_cache_alloc(struct kmem_cache *cache){
+  void *obj = 0;
+  struct kmem_cpu *c;
+
+  intr_push();
+  c = &cache->cpu[get_coreid()];
+  if (c->cnt == 0)
+    cpu_refill(cache, c);
+  if (c->cnt)
+    obj = c->objs[--c->cnt];
+  intr_pop();
+  return obj;
+}
+
+/* Free obj, which came from kmem_cache_alloc(cache) */
+void kmem_cache_free(struct kmem_cache *cache, void *obj){
+  struct kmem_cpu *c;
+
+  intr_push();
+  c = &cache->cpu[get_coreid()];
+  if (c->cnt == KMEM_CPU_CACHE)
+    cpu_flush(cache, c);
+  c->objs[c->cnt++] = obj;
+  intr_pop();
+}
+
+/* Allocate size bytes from the smallest fitting size class, 
+return 0 if size is too large or out of memory */
+void* kmem_alloc(uint32_t size){
+  uint32_t class_size = 16;
+  for (int i = 0; i < NSIZE_CLASS; i++, class_size <<= 1){
+    if (size <= class_size)
+      return kmem_cache_alloc(&size_caches[i]);
+  }
+  return 0;
+}
+
+/* Free obj, which came from kmem_alloc() */
+void kmem_free(void *obj){
+  /* Size class slabs are single pages, so the header is found 
+  by rounding down to the page */
+  struct slab *s = (struct slab*)((uint64_t)obj & ~((uint64_t)PSIZE-1));
+  if (s->cache < size_caches || s->cache >= size_caches + NSIZE_CLASS)
+    kerror(__FILE_NAME__,__LINE__,"kmem_free: not a kmem_alloc object");
+  kmem_cache_free(s->cache, obj);
+}
@@ -1,8 +1,7 @@
 #include "../include/sleeplock.h"
 #include "../include/spinlock.h"
 #include "../include/proc.h"
-
-//FIXME
+#include "../include/sched.h"
 
 void initsleeplock(struct sleeplock *lk, char *name)
 {
@@ -12,38 +11,35 @@ void initsleeplock(struct sleeplock *lk, char *name)
   lk->pid = 0;
 }
 
-// void
-// acquiresleep(struct sleeplock *lk)
-// {
-//   acquire_spinlock(&lk->lk);
-//   while (lk->locked) {
-//     // sleep(lk, &lk->lk);
-//   }
-//   lk->locked = 1;
-//   lk->pid = get_myproc()->pid;
-//   release_spinlock(&lk->lk);
-// }
+void
+acquiresleep(struct sleeplock *lk)
+{
+  acquire_spinlock(&lk->lk);
+  while (lk->locked) {
+    sleep(lk, &lk->lk);
+  }
+  lk->locked = 1;
+  lk->pid = get_myproc()->pid;
+  release_spinlock(&lk->lk);
+}
 
-// void
-// releasesleep(struct sleeplock *lk)
-// {
-//   acquire_spinlock(&lk->lk);
-//   lk->locked = 0;
-//   lk->pid = 0;
-// //   wakeup(lk);
-//   release_spinlock(&lk->lk);
-// }
+void
+releasesleep(struct sleeplock *lk)
+{
+  acquire_spinlock(&lk->lk);
+  lk->locked = 0;
+  lk->pid = 0;
+  wakeup(lk);
+  release_spinlock(&lk->lk);
+}
 
-// int
-// holdingsleep(struct sleeplock *lk)
-// {
-//   int r;
+int
+holdingsleep(struct sleeplock *lk)
+{
+  int r;
   
-//   acquire_spinlock(&lk->lk);
-//   r = lk->locked && (lk->pid == get_myproc()->pid);
-//   release_spinlock(&lk->lk);
-//   return r;
-// }
-
-
-
+  acquire_spinlock(&lk->lk);
+  r = lk->locked && (lk->pid == get_myproc()->pid);
+  release_spinlock(&lk->lk);
+  return r;
+}
@@ -7,7 +7,7 @@
 #include "../include/spinlock.h"
 #include "../include/proc.h"
 #include "../include/kerror.h"
-
+#include "../include/sched.h"
 /*
 However, the interrupt may already be disabled before the first time of 
 acquiring the lock. Also, we have to deal will nested acquiring lock 
@@ -53,11 +53,35 @@ void intr_pop(){
         // kerror();          
 
     /* Outter most level of disable, turn on interrupt if it is 
-    on previously. */
+    on previously. Nothing is held any more, so this is also where 
+    kernel code gets preempted if a switch is due. */
+    core->disable_cnt--;
     if (core->disable_cnt == 0 && core->prev_int_state == 1){
+        int resched = core->need_resched && core->preempt_cnt == 0 && 
+                      core->proc != 0;
         write_sstatus(read_sstatus() | SSTATUS_SIE);
+        if (resched)
+            preempt_schedule();
     }
-    core->disable_cnt--;
+}
+
+/* 
+Keep the current process on this core without disabling interrupts. 
+Counted per core, so code in between must not sleep. 
+*/
+void preempt_disable(){
+    intr_push();
+    get_mycore()->preempt_cnt++;
+    intr_pop();
+}
+
+void preempt_enable(){
+    intr_push();
+    if (get_mycore()->preempt_cnt < 1)
+        kerror(__FILE_NAME__,__LINE__,"preempt_enable");
+    get_mycore()->preempt_cnt--;
+    /* The preemption point in intr_pop() catches a pending switch */
+    intr_pop();
 }
 
 /* Test if the current CPU is holding the lock */
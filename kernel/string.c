@@ -4,7 +4,35 @@
 
 void* memset(void *ptr, int c, unsigned int len){
     char *dst = (char *) ptr;
-    for(int i = 0; i < len; i++)
-        dst[i] = c;
+    /* c replicated into every byte of a word */
+    uint64_t word = (uint8_t)c * 0x0101010101010101UL;
+
+    /* Bytes up to the first 8-byte boundary, then whole words */
+    while (len && ((uint64_t)dst & 7)){
+        *dst++ = c;
+        len--;
+    }
+    for (; len >= 8; len -= 8, dst += 8)
+        *(uint64_t *)dst = word;
+    while (len--)
+        *dst++ = c;
+    return ptr;
+}
+
+void* memcpy(void *dst, const void *src, unsigned int len){
+    char *d = (char *) dst;
+    const char *s = (const char *) src;
+
+    /* Whole words when both sides share the same alignment */
+    if ((((uint64_t)d ^ (uint64_t)s) & 7) == 0){
+        while (len && ((uint64_t)d & 7)){
+            *d++ = *s++;
+            len--;
+        }
+        for (; len >= 8; len -= 8, d += 8, s += 8)
+            *(uint64_t *)d = *(const uint64_t *)s;
+    }
+    while (len--)
+        *d++ = *s++;
     return dst;
 }
\ No newline at end of file
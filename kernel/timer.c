@@ -2,8 +2,26 @@
 #include "../include/riscv.h"
 #include "../include/types.h"
 #include "../include/param.h"
+#include "../include/mmio.h"
+#include "../include/spinlock.h"
+#include "../include/proc.h"
 
-uint64_t scratch[NCORE][5];
+uint64_t scratch[NCORE][6];
+
+/* 
+Supervisor side. Each hart keeps the earliest event asked for with 
+timer_request(). While the hart has work it also takes periodic 
+ticks; when it goes idle it switches to tickless mode and mtimecmp 
+holds only that event, or nothing at all. A later request made while 
+an earlier one is pending is dropped, so the scheduler asks for its 
+events again on every tick (see sched_tick()). mtime/mtimecmp are 
+reached through the CLINT mapping in the kernel page table. Only the 
+owning hart touches its entry, with interrupts off.
+*/
+static struct {
+    uint64_t deadline;   // earliest requested event, TIMER_NONE if none
+    int tickless;
+} __attribute__((aligned(64))) tstate[NCORE];
 
 /* 
 Timer interrupts come from clock hardware attached to each 
@@ -38,5 +56,79 @@ void timer_init(){
     handler. */
     scratch[cpu_id][3] = CLINT_MTIMECMP(cpu_id);
     scratch[cpu_id][4] = TIMER_INTERVAL;
+    scratch[cpu_id][5] = CLINT_MSIP(cpu_id);
+    tstate[cpu_id].deadline = TIMER_NONE;
+    tstate[cpu_id].tickless = 0;
     write_mscratch((uint64_t)scratch[cpu_id]);
-}
\ No newline at end of file
+}
+
+uint64_t timer_now(){
+    return mm_readd(CLINT_MTIME);
+}
+
+/* Make sure this hart takes a timer interrupt at mtime >= deadline */
+void timer_request(uint64_t deadline){
+    int id;
+
+    intr_push();
+    id = get_coreid();
+    if (deadline < tstate[id].deadline)
+        tstate[id].deadline = deadline;
+    /* A periodic tick may already come earlier */
+    if (deadline < mm_readd(CLINT_MTIMECMP(id)))
+        mm_writed(CLINT_MTIMECMP(id), deadline);
+    intr_pop();
+}
+
+/* 
+Called on every forwarded interrupt, timer or IPI alike. Retires the 
+pending event if it is due and, when tickless, re-arms mtimecmp that 
+mti_handler parked. Returns 1 if the event was due.
+*/
+int timer_handle(){
+    int id, due = 0;
+
+    intr_push();
+    id = get_coreid();
+    if (tstate[id].deadline <= timer_now()){
+        tstate[id].deadline = TIMER_NONE;
+        due = 1;
+    }
+    if (tstate[id].tickless)
+        mm_writed(CLINT_MTIMECMP(id), tstate[id].deadline);
+    intr_pop();
+    return due;
+}
+
+/* Resume periodic ticks, the hart has work to time-slice */
+void timer_periodic(){
+    int id;
+    uint64_t next;
+
+    intr_push();
+    id = get_coreid();
+    if (tstate[id].tickless){
+        tstate[id].tickless = 0;
+        scratch[id][4] = TIMER_INTERVAL;
+        next = timer_now() + TIMER_INTERVAL;
+        if (tstate[id].deadline < next)
+            next = tstate[id].deadline;
+        mm_writed(CLINT_MTIMECMP(id), next);
+    }
+    intr_pop();
+}
+
+/* Stop periodic ticks before idling, only requested events remain */
+void timer_tickless(){
+    int id;
+
+    intr_push();
+    id = get_coreid();
+    if (!tstate[id].tickless){
+        tstate[id].tickless = 1;
+        /* mti_handler parks mtimecmp from now on */
+        scratch[id][4] = 0;
+        mm_writed(CLINT_MTIMECMP(id), tstate[id].deadline);
+    }
+    intr_pop();
+}
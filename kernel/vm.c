@@ -10,6 +10,10 @@
 #include "../include/string.h"
 #include "../include/printk.h"
 #include "../include/types.h"
+#include "../include/spinlock.h"
+#include "../include/proc.h"
+#include "../include/timer.h"
+#include "../include/ipi.h"
 
 /* 
  * xv6 runs on Sv39 RISC-V, which means that only the bottom 39 bits of a 64-bit virtual 
@@ -38,20 +42,51 @@ extern char trap[];
 
 ptb_t kernel_ptb;
 
-/* Return the address of the PTE in page table pagetable that corresponds to virtual 
-address va. Create any required page-table if needed.
-Return lowest level PTE address, which pointing to a data page */
-pte_t* search_pt_tree(ptb_t pagetable, uint64_t va, int alloc){
+/* Per-call mapping logs, `make VM_DEBUG=1 ...` to turn on */
+#ifdef VM_DEBUG
+#define vm_log(...) printk(__VA_ARGS__)
+#else
+#define vm_log(...)
+#endif
+
+/*
+ * ASID allocation:
+ * ASID 0 belongs to the kernel page table. User address spaces get ASIDs 
+ * 1..max from a counter. When the counter runs out, the generation is bumped 
+ * and numbering restarts, so every process holding an ASID of an older 
+ * generation gets a new one the next time it is switched in, and every core 
+ * flushes its TLB once when it first sees the new generation.
+ */
+struct {
+  struct spinlock lock;
+  uint64_t generation;
+  uint64_t next;       // next ASID to hand out in this generation
+  uint64_t max;        // largest ASID implemented, 0 if there are none
+} asids;
+
+#define ASID_GEN_SHIFT 16
+
+/* Return the address of the PTE that maps va at *level (0, 1 or 2) in page 
+table pagetable. Create any required page-table if alloc is set. 
+If a superpage leaf is met above *level, that leaf is returned and *level 
+is updated to its level.
+Return 0 if the page table is missing and not allocated */
+pte_t* search_pt_level(ptb_t pagetable, uint64_t va, int *level, int alloc){
     if (va > MAXVA) 
         kerror(__FILE_NAME__,__LINE__,"Illegal virtual memory address");
 
-    for (int level = 2; level > 0; level--){
+    for (int l = 2; l > *level; l--){
         /* Get the index for the current level of page table */
-        uint64_t idx = GET_PT_IDX(va, level);
+        uint64_t idx = GET_PT_IDX(va, l);
         /* Get PTE from page table */
         pte_t* pte = &pagetable[idx];
 
         if (PTE_VALID(*pte)) {
+            /* A leaf here maps a whole 2 MiB / 1 GiB superpage */
+            if (PTE_LEAF(*pte)) {
+                *level = l;
+                return pte;
+            }
             /* If this PTE is valid, then we get PA from this PTE and
                may going into the next level of page table using this 
                PA */
@@ -60,81 +95,492 @@ pte_t* search_pt_tree(ptb_t pagetable, uint64_t va, int alloc){
             /* If it is not valid (not initialized), then allocate 
                and initialize the corresponding page table, return 
                0 */
-            if(!alloc || (pagetable = (uint64_t*)kmalloc()) == 0) return 0;
-            // printk("[vm.c] allocated page %p for level %d page table\n", pagetable, level-1);
-            memset(pagetable, 0, PSIZE);
+            if(!alloc || (pagetable = (uint64_t*)kzalloc()) == 0) return 0;
+            // printk("[vm.c] allocated page %p for level %d page table\n", pagetable, l-1);
             *pte = GET_PTE(pagetable) | PTE_V;
         }
     }
-    return &pagetable[GET_PT_IDX(va, 0)];
+    return &pagetable[GET_PT_IDX(va, *level)];
+}
+
+/* Return the address of the PTE in page table pagetable that corresponds to virtual 
+address va. Create any required page-table if needed.
+Return lowest level PTE address, which pointing to a data page. Callers 
+work on 4 KiB pages only, a superpage leaf over va is an error */
+pte_t* search_pt_tree(ptb_t pagetable, uint64_t va, int alloc){
+    int level = 0;
+    pte_t *pte = search_pt_level(pagetable, va, &level, alloc);
+    if (level != 0)
+        kerror(__FILE_NAME__,__LINE__,"search_pt_tree: superpage");
+    return pte;
+}
+
+/* Non-zero if the page table t at level maps nothing, itself or below */
+static int pt_empty(ptb_t t, int level){
+    for (int i = 0; i <= PTIDX_MASK; i++){
+        if (!PTE_VALID(t[i]))
+            continue;
+        if (level == 0 || PTE_LEAF(t[i]) || !pt_empty((ptb_t)GET_PA(t[i]), level-1))
+            return 0;
+    }
+    return 1;
 }
 
-/* Map physical and virtual pages */
-int map_pages(ptb_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm, char* purp){
+/* Free the empty page table t at level and the tables below it */
+static void pt_free(ptb_t t, int level){
+    for (int i = 0; level > 0 && i <= PTIDX_MASK; i++)
+        if (PTE_VALID(t[i]))
+            pt_free((ptb_t)GET_PA(t[i]), level-1);
+    kfree(t);
+}
+
+/* Entries left in the level-0 table holding va, capped at npages */
+static uint64_t run_len(uint64_t va, uint64_t npages){
+    uint64_t left = PTIDX_MASK + 1 - GET_PT_IDX(va, 0);
+    return left < npages ? left : npages;
+}
+
+/* Above this many (un)mapped pages one full flush beats per-page flushes */
+#define UNMAP_FLUSH_ALL 64
+
+/* Fence va in the address space with ASID asid (as kept in proc->asid), 
+0 for the kernel page table or when there are no ASIDs */
+static void fence_page(uint64_t asid, uint64_t va){
+    if (asid & SATP_ASID_MASK)
+        sfence_vma_page_asid(va, asid & SATP_ASID_MASK);
+    else
+        sfence_vma_page(va);
+}
+
+/* Fence the whole address space with ASID asid */
+static void fence_all(uint64_t asid){
+    if (asid & SATP_ASID_MASK)
+        sfence_vma_asid(asid & SATP_ASID_MASK);
+    else
+        sfence_vma_all();
+}
+/* Map physical and virtual pages. 4 KiB leaves are written one level-0 
+table at a time: one walk, then up to 512 consecutive PTEs. asid is the 
+owner's proc->asid, 0 for the kernel page table, and limits the fences 
+to that address space. */
+int map_pages(ptb_t pagetable, uint64_t asid, uint64_t va, uint64_t size, uint64_t pa, int perm, char* purp){
     if (size <= 0)
         kerror(__FILE_NAME__,__LINE__,"Incorrect size");
     uint64_t curr_va = ADDR_ROUND(va, PSIZE, 0);
     uint64_t end_va  = ADDR_ROUND((va+size), PSIZE, 0);
-    printk("[vm.c] Mapping va[%p-%p] to pa[%p] for %s\n",curr_va, end_va, pa, purp);
+    uint64_t start_va = curr_va;
+    vm_log("[vm.c] Mapping va[%p-%p] to pa[%p] for %s\n",curr_va, end_va, pa, purp);
     pte_t* pte;
-
+    int freed = 0;
     while (curr_va < end_va) {
-        if ((pte = search_pt_tree(pagetable, curr_va, PG_ALLOC)) == 0) return 0;
-        if (PTE_VALID(*pte)) 
+        int level = 0, got;
+        /* Pick the largest leaf that va, pa and the rest of the range allow */
+        if (perm & MAP_SUPER) {
+            for (level = 2; level > 0; level--) {
+                uint64_t sz = LEVEL_SIZE(level);
+                if (!(curr_va & (sz-1)) && !(pa & (sz-1)) && end_va - curr_va >= sz)
+                    break;
+            }
+        }
+        got = level;
+        if ((pte = search_pt_level(pagetable, curr_va, &got, PG_ALLOC)) == 0) return 0;
+        if (got != level) 
             kerror(__FILE_NAME__,__LINE__,"PTE already valid");
-        *pte = GET_PTE(pa) | perm | PTE_V;
-        curr_va += PSIZE;
-        pa += PSIZE;
+        /* unmap_pages() leaves emptied tables behind. One that maps 
+        nothing gives its slot to the superpage, otherwise the range is 
+        filled in with 4 KiB pages */
+        if (level && PTE_VALID(*pte) && !PTE_LEAF(*pte)) {
+            if (pt_empty((ptb_t)GET_PA(*pte), level-1)) {
+                pt_free((ptb_t)GET_PA(*pte), level-1);
+                *pte = 0;
+                freed = 1;
+            } else {
+                level = got = 0;
+                if ((pte = search_pt_level(pagetable, curr_va, &got, PG_ALLOC)) == 0) return 0;
+                if (got != level) 
+                    kerror(__FILE_NAME__,__LINE__,"PTE already valid");
+            }
+        }
+        /* A run of 4 KiB pages ends with its level-0 table, which is 
+        also the next point a superpage could start */
+        uint64_t n = level ? 1 : run_len(curr_va, (end_va - curr_va) / PSIZE);
+        for (uint64_t i = 0; i < n; i++) {
+            if (PTE_VALID(pte[i])) 
+                kerror(__FILE_NAME__,__LINE__,"PTE already valid");
+            pte[i] = GET_PTE(pa) | (perm & PTE_FLAGS) | PTE_V;
+            pa += LEVEL_SIZE(level);
+        }
+        curr_va += n * LEVEL_SIZE(level);
     }
 
+    /* Without Svvptc the walker may cache invalid entries too, so new 
+    mappings need a fence like removed ones. This only covers this hart, 
+    callers mapping kernel memory other harts may use shoot it down. 
+    Page fences leave non-leaf entries of freed tables cached. */
+    if (freed || (end_va - start_va) / PSIZE > UNMAP_FLUSH_ALL) {
+        fence_all(asid);
+    } else {
+        for (curr_va = start_va; curr_va < end_va; curr_va += PSIZE)
+            fence_page(asid, curr_va);
+    }
     return 1;
 }
 
-/* Unmap physical and virtual pages */
-int unmap_pages(ptb_t pagetable, uint64_t va, uint64_t size){
+
+/* Unmap physical and virtual pages, one level-0 table at a time. asid 
+as for map_pages() */
+int unmap_pages(ptb_t pagetable, uint64_t asid, uint64_t va, uint64_t size){
     if (size <= 0)
         kerror(__FILE_NAME__,__LINE__,"Incorrect size");
     uint64_t curr_va = ADDR_ROUND(va, PSIZE, 0);
     uint64_t end_va  = ADDR_ROUND((va+size), PSIZE, 0);
-    printk("[vm.c] Unmapping va[%p-%p]\n",curr_va, end_va);
+    int flush_all = (end_va - curr_va) / PSIZE > UNMAP_FLUSH_ALL;
+    vm_log("[vm.c] Unmapping va[%p-%p]\n",curr_va, end_va);
     pte_t* pte;
 
     while (curr_va < end_va) {
-        if ((pte = search_pt_tree(pagetable, curr_va, PG_NOT_ALLOC)) == 0) 
+        int level = 0;
+        if ((pte = search_pt_level(pagetable, curr_va, &level, PG_NOT_ALLOC)) == 0) 
             kerror(__FILE_NAME__,__LINE__,"search_pt_tree error");
-        if ((*pte & PTE_V) == 0 || ((*pte & 0x3FF) == PTE_V))
-            kerror(__FILE_NAME__,__LINE__,"unmap page valid error");
+        uint64_t sz = LEVEL_SIZE(level);
+        uint64_t n = 1;
+        if (level == 0) {
+            n = run_len(curr_va, (end_va - curr_va) / PSIZE);
+            for (uint64_t i = 0; i < n; i++) {
+                if ((pte[i] & PTE_V) == 0 || !PTE_LEAF(pte[i]))
+                    kerror(__FILE_NAME__,__LINE__,"unmap page valid error");
+                kfree((void*)GET_PA(pte[i]));
+                pte[i] = 0;
+                /* Only this page goes, other translations stay warm */
+                if (!flush_all)
+                    fence_page(asid, curr_va + i * PSIZE);
+            }
+        } else {
+            if ((*pte & PTE_V) == 0 || !PTE_LEAF(*pte))
+                kerror(__FILE_NAME__,__LINE__,"unmap page valid error");
+            /* Superpages can only be unmapped as a whole */
+            if ((curr_va & (sz-1)) || end_va - curr_va < sz)
+                kerror(__FILE_NAME__,__LINE__,"unmap splits a superpage");
+            for (uint64_t off = 0; off < sz; off += LEVEL_SIZE(1))
+                kfree_pages((void*)(GET_PA(*pte) + off), SUPERPAGE_ORDER);
+            *pte = 0;
+            if (!flush_all)
+                fence_page(asid, curr_va);
+        }
+        curr_va += n * sz;
+    }
+    if (flush_all)
+        fence_all(asid);
+    return 1;
+}
+
+
+/* 
+Share the user pages mapped in [0, sz) of old with new copy-on-write: 
+writable pages become read-only + PTE_COW in both tables and every 
+shared page gets one more reference. Unmapped pages are skipped.
+The caller must flush old's TLB entries afterwards.
+return 1 on success or 0 if new ran out of page-table pages
+*/
+int uvm_cow_copy(ptb_t old, ptb_t new, uint64_t sz){
+    pte_t *pte, *npte;
+    uint64_t va;
+
+    for (va = 0; va < sz; va += PSIZE){
+        if ((pte = search_pt_tree(old, va, PG_NOT_ALLOC)) == 0 || !PTE_VALID(*pte))
+            continue;
+        if (PTE_WRITE(*pte))
+            *pte = (*pte & ~PTE_W) | PTE_COW;
+        if ((npte = search_pt_tree(new, va, PG_ALLOC)) == 0)
+            goto fail;
+        if (PTE_VALID(*npte))
+            kerror(__FILE_NAME__,__LINE__,"uvm_cow_copy: PTE already valid");
+        kpage_share((void*)GET_PA(*pte));
+        *npte = *pte;
+    }
+    return 1;
+
+fail:
+    /* Drop the references taken so far, old keeps its pages */
+    for (uint64_t v = 0; v < va; v += PSIZE){
+        if ((npte = search_pt_tree(new, v, PG_NOT_ALLOC)) == 0 || !PTE_VALID(*npte))
+            continue;
+        kfree((void*)GET_PA(*npte));
+        *npte = 0;
+    }
+    return 0;
+}
+
+/* 
+Handle a store to va in pagetable. If va is a copy-on-write page, give 
+the faulting address space its own writable copy, or just make the page 
+writable again when nobody else shares it any more.
+return 1 if the store can be retried or 
+return 0 if va is not a copy-on-write page or memory is out
+*/
+int cow_fault(ptb_t pagetable, uint64_t va){
+    pte_t *pte;
+    void *pa, *copy;
+
+    if (va >= MAXVA)
+        return 0;
+    va = ADDR_ROUND(va, PSIZE, 0);
+    if ((pte = search_pt_tree(pagetable, va, PG_NOT_ALLOC)) == 0 ||
+        !PTE_VALID(*pte) || !PTE_USER(*pte) || !(*pte & PTE_COW))
+        return 0;
+
+    pa = (void*)GET_PA(*pte);
+    if (kpage_refs(pa) == 1){
+        /* Last owner, keep the page */
+        *pte = (*pte | PTE_W) & ~PTE_COW;
+    } else {
+        if ((copy = kmalloc()) == 0)
+            return 0;
+        memcpy(copy, pa, PSIZE);
+        *pte = GET_PTE(copy) | ((*pte | PTE_W) & ~PTE_COW & PTE_FLAGS);
+        /* Drop our reference to the shared page */
+        kfree(pa);
+    }
+    sfence_vma_page(va);
+    return 1;
+}
+
+/* 
+Handle a load or store to an unmapped va of a process whose memory 
+is [0, sz). Memory is only reserved when the process grows, the page 
+is allocated zeroed and mapped here on first touch.
+return 1 if the access can be retried or 
+return 0 if va is outside [0, sz), already mapped, or memory is out
+*/
+int lazy_fault(ptb_t pagetable, uint64_t sz, uint64_t va){
+    pte_t *pte;
+    void *page;
+
+    if (va >= sz || va >= MAXUVA)
+        return 0;
+    va = ADDR_ROUND(va, PSIZE, 0);
+    if ((pte = search_pt_tree(pagetable, va, PG_ALLOC)) == 0 || PTE_VALID(*pte))
+        return 0;
+    if ((page = kzalloc()) == 0)
+        return 0;
+    *pte = GET_PTE(page) | PTE_U | PTE_R | PTE_W | PTE_V;
+    /* The walker may have cached the old invalid entry */
+    sfence_vma_page(va);
+    return 1;
+}
+
+/* Free the user pages in [newsz, oldsz) that have been touched, 
+pages never faulted in have nothing to free */
+void uvm_dealloc(ptb_t pagetable, uint64_t oldsz, uint64_t newsz){
+    pte_t *pte;
+
+    for (uint64_t va = ADDR_ROUND(newsz, PSIZE, 1); va < oldsz; va += PSIZE){
+        if ((pte = search_pt_tree(pagetable, va, PG_NOT_ALLOC)) == 0 || !PTE_VALID(*pte))
+            continue;
         kfree((void*)GET_PA(*pte));
         *pte = 0;
-        curr_va += PSIZE;
+        sfence_vma_page(va);
+    }
+}
+
+/* Pages handed to kfree_bulk() at once by uvm_free() */
+#define FREE_BATCH 64
+
+/* Queue page for a bulk free, flushing the batch when it is full */
+#define FREE_LATER(page) do { \
+        batch[n++] = (void*)(page); \
+        if (n == FREE_BATCH) { kfree_bulk(batch, n); n = 0; } \
+    } while (0)
+
+/* 
+Tear down a whole user address space: free every user (PTE_U) page and 
+every page-table page, root included. Kernel-only leaves such as the 
+trampoline and the trap frame are left to their owners. The three levels 
+are walked with plain loops, each table is visited once, and pages are 
+freed in batches. No TLB flush is done here, the caller flushes the 
+address space once.
+*/
+void uvm_free(ptb_t pagetable){
+    void *batch[FREE_BATCH];
+    int n = 0;
+
+    for (int i2 = 0; i2 <= PTIDX_MASK; i2++){
+        pte_t pte2 = pagetable[i2];
+        if (!PTE_VALID(pte2))
+            continue;
+        if (PTE_LEAF(pte2)){
+            if (PTE_USER(pte2))
+                kerror(__FILE_NAME__,__LINE__,"uvm_free: 1 GiB user page");
+            continue;
+        }
+        ptb_t l1 = (ptb_t)GET_PA(pte2);
+        for (int i1 = 0; i1 <= PTIDX_MASK; i1++){
+            pte_t pte1 = l1[i1];
+            if (!PTE_VALID(pte1))
+                continue;
+            if (PTE_LEAF(pte1)){
+                if (PTE_USER(pte1))
+                    kfree_pages((void*)GET_PA(pte1), SUPERPAGE_ORDER);
+                continue;
+            }
+            ptb_t l0 = (ptb_t)GET_PA(pte1);
+            for (int i0 = 0; i0 <= PTIDX_MASK; i0++){
+                pte_t pte0 = l0[i0];
+                if (PTE_VALID(pte0) && PTE_USER(pte0))
+                    FREE_LATER(GET_PA(pte0));
+            }
+            FREE_LATER(l0);
+        }
+        FREE_LATER(l1);
+    }
+    FREE_LATER(pagetable);
+    if (n)
+        kfree_bulk(batch, n);
+}
+
+/* 
+Translate the user page va (page aligned) of pagetable for a kernel copy. 
+Pages of the current process that are reserved but untouched are faulted 
+in, and copy-on-write pages are broken when the kernel writes to them, 
+exactly as if the process had touched them itself.
+return the physical page, which the kernel reaches directly, or 
+return 0 if the user may not access it that way
+*/
+static uint64_t user_page(ptb_t pagetable, uint64_t va, int write){
+    proc_t *p = get_myproc();
+    pte_t *pte;
+
+    if (va >= MAXUVA)
+        return 0;
+    pte = search_pt_tree(pagetable, va, PG_NOT_ALLOC);
+    if (pte == 0 || !PTE_VALID(*pte)){
+        if (p == 0 || p->pagetable != pagetable || !lazy_fault(pagetable, p->sz, va))
+            return 0;
+        pte = search_pt_tree(pagetable, va, PG_NOT_ALLOC);
+    }
+    if (!PTE_USER(*pte))
+        return 0;
+    if (write && !PTE_WRITE(*pte)){
+        if (!cow_fault(pagetable, va))
+            return 0;
+        if (p && p->pagetable == pagetable)
+            tlb_shootdown_page(p, va);
+    }
+    if (!write && !PTE_READ(*pte))
+        return 0;
+    return GET_PA(*pte);
+}
+
+/* 
+Copy len bytes from kernel src to user dstva. The walk is done once per 
+page and the data is moved by memcpy(), a word at a time when aligned.
+return 1 on success or 0 on a bad user address
+*/
+int copyout(ptb_t pagetable, uint64_t dstva, const char *src, uint64_t len){
+    while (len > 0){
+        uint64_t va0 = ADDR_ROUND(dstva, PSIZE, 0);
+        uint64_t pa0 = user_page(pagetable, va0, 1);
+        if (pa0 == 0)
+            return 0;
+        uint64_t n = PSIZE - (dstva - va0);
+        if (n > len) n = len;
+        memcpy((void*)(pa0 + (dstva - va0)), src, n);
+        len -= n;
+        src += n;
+        dstva = va0 + PSIZE;
     }
     return 1;
 }
 
+/* 
+Copy len bytes from user srcva to kernel dst.
+return 1 on success or 0 on a bad user address
+*/
+int copyin(ptb_t pagetable, char *dst, uint64_t srcva, uint64_t len){
+    while (len > 0){
+        uint64_t va0 = ADDR_ROUND(srcva, PSIZE, 0);
+        uint64_t pa0 = user_page(pagetable, va0, 0);
+        if (pa0 == 0)
+            return 0;
+        uint64_t n = PSIZE - (srcva - va0);
+        if (n > len) n = len;
+        memcpy(dst, (void*)(pa0 + (srcva - va0)), n);
+        len -= n;
+        dst += n;
+        srcva = va0 + PSIZE;
+    }
+    return 1;
+}
+
+/* Non-zero if any byte of the word v is zero */
+#define HAS_ZERO_BYTE(v) (((v) - 0x0101010101010101UL) & ~(v) & 0x8080808080808080UL)
+
+/* 
+Copy a null-terminated string from user srcva to kernel dst, copying at 
+most max bytes including the terminator. Aligned strings are scanned and 
+copied a word at a time until the word holding the terminator.
+return 1 on success or 0 on a bad address or a string longer than max
+*/
+int copyinstr(ptb_t pagetable, char *dst, uint64_t srcva, uint64_t max){
+    while (max > 0){
+        uint64_t va0 = ADDR_ROUND(srcva, PSIZE, 0);
+        uint64_t pa0 = user_page(pagetable, va0, 0);
+        if (pa0 == 0)
+            return 0;
+        uint64_t n = PSIZE - (srcva - va0);
+        if (n > max) n = max;
+        const char *p = (const char*)(pa0 + (srcva - va0));
+        uint64_t i = 0;
+
+        if ((((uint64_t)p ^ (uint64_t)dst) & 7) == 0){
+            while (i < n && ((uint64_t)(p + i) & 7)){
+                if ((dst[i] = p[i]) == 0)
+                    return 1;
+                i++;
+            }
+            for (; i + 8 <= n; i += 8){
+                uint64_t w = *(const uint64_t*)(p + i);
+                if (HAS_ZERO_BYTE(w))
+                    break;
+                *(uint64_t*)(dst + i) = w;
+            }
+        }
+        for (; i < n; i++){
+            if ((dst[i] = p[i]) == 0)
+                return 1;
+        }
+        max -= n;
+        dst += n;
+        srcva = va0 + PSIZE;
+    }
+    return 0;
+}
 
 /* Initialize virtual memory for kernel space */
 void kernel_vm_init(){
-    kernel_ptb = (ptb_t)kmalloc();
-    memset((void*)kernel_ptb, 0, PSIZE);
+    kernel_ptb = (ptb_t)kzalloc();
 
     printk("+------------------------------------------+\n");
     printk("|              kernel_vm_init              |\n");
     printk("+------------------------------------------+\n");
 
     // Text
-    if (!map_pages(kernel_ptb, KBASE, (uint64_t)etext-KBASE, KBASE, PTE_R | PTE_X, "Kernel text"))
+    if (!map_pages(kernel_ptb, 0, KBASE, (uint64_t)etext-KBASE, KBASE, PTE_R | PTE_X | MAP_SUPER, "Kernel text"))
         kerror(__FILE_NAME__,__LINE__,"Error in mapping Kernel text");
     // Data
-    if (!map_pages(kernel_ptb, (uint64_t)etext, (uint64_t)end-(uint64_t)etext, (uint64_t)etext, PTE_R | PTE_W, "Kernel data"))
+    if (!map_pages(kernel_ptb, 0, (uint64_t)etext, (uint64_t)end-(uint64_t)etext, (uint64_t)etext, PTE_R | PTE_W | MAP_SUPER, "Kernel data"))
         kerror(__FILE_NAME__,__LINE__,"Error in mapping Kernel data");
     // UART
-    if (!map_pages(kernel_ptb, UART_BASE, PSIZE, UART_BASE, PTE_R | PTE_W, "UART"))
+    if (!map_pages(kernel_ptb, 0, UART_BASE, PSIZE, UART_BASE, PTE_R | PTE_W, "UART"))
         kerror(__FILE_NAME__,__LINE__,"Error in mapping UART");
+    // CLINT, msip for IPIs and mtime/mtimecmp
+    if (!map_pages(kernel_ptb, 0, CLINT, 0x10000, CLINT, PTE_R | PTE_W, "CLINT"))
+        kerror(__FILE_NAME__,__LINE__,"Error in mapping CLINT");
     // PLIC
-    if (!map_pages(kernel_ptb, PLIC, 0x400000, PLIC, PTE_R | PTE_W, "PLIC"))
+    if (!map_pages(kernel_ptb, 0, PLIC, 0x400000, PLIC, PTE_R | PTE_W | MAP_SUPER, "PLIC"))
         kerror(__FILE_NAME__,__LINE__,"Error in mapping PLIC");
     // Virtio
-    if (!map_pages(kernel_ptb, VIRTIO, PSIZE, VIRTIO, PTE_R | PTE_W, "Virtio"))
+    if (!map_pages(kernel_ptb, 0, VIRTIO, PSIZE, VIRTIO, PTE_R | PTE_W, "Virtio"))
         kerror(__FILE_NAME__,__LINE__,"Error in mapping Virtio");
     
     /* Trap 
@@ -142,12 +588,79 @@ void kernel_vm_init(){
      * KER_BASE, so we mapped MAXVA-PSIZE to trap which is defined in the 
      * linker script 
      */
-    if (!map_pages(kernel_ptb, MAXVA-PSIZE, PSIZE, (uint64_t)trap, PTE_R | PTE_X, "Trap"))
+    if (!map_pages(kernel_ptb, 0, MAXVA-PSIZE, PSIZE, (uint64_t)trap, PTE_R | PTE_X, "Trap"))
         kerror(__FILE_NAME__,__LINE__,"Error in mapping trap");
 
-    asm ("sfence.vma zero, zero");
-    write_satp((uint64_t)kernel_ptb >> 12 | (1L << 63));
-    asm ("sfence.vma zero, zero");
+    kernel_vm_init_hart();
+
+    /* The ASID field is WARL: write all ones and read back how many 
+    bits stick */
+    write_satp(MAKE_SATP(kernel_ptb, SATP_ASID_MASK));
+    asids.max = GET_SATP_ASID(read_satp());
+    write_satp(MAKE_SATP(kernel_ptb, 0));
+    sfence_vma_all();
+    spinlock_init(&asids.lock);
+    asids.generation = 1;
+    asids.next = 1;
+    printk("[vm.c] %d ASIDs available\n", (int)asids.max);
+}
+
+/* Switch the current hart to the kernel page table */
+void kernel_vm_init_hart(){
+    sfence_vma_all();
+    write_satp(MAKE_SATP(kernel_ptb, 0));
+    sfence_vma_all();
+}
+
+/* Return the satp value to run proc with, giving it a fresh ASID if it 
+has none in the current generation. Must be called on the core that is 
+about to switch to proc's page table. */
+uint64_t proc_satp(proc_t* proc){
+    uint64_t gen;
+
+    if (asids.max == 0){
+        /* Still a shootdown target while running user code here */
+        __sync_fetch_and_or(&proc->cpumask, 1UL << get_coreid());
+        return MAKE_SATP(proc->pagetable, 0);
+    }
+
+    /* The common case, an ASID of the current generation, takes no lock */
+    gen = __atomic_load_n(&asids.generation, __ATOMIC_ACQUIRE);
+    if ((proc->asid >> ASID_GEN_SHIFT) != gen){
+        acquire_spinlock(&asids.lock);
+        if ((proc->asid >> ASID_GEN_SHIFT) != asids.generation){
+            if (asids.next > asids.max){
+                /* Rollover: start a new generation */
+                __atomic_store_n(&asids.generation, asids.generation + 1, __ATOMIC_RELEASE);
+                asids.next = 1;
+            }
+            proc->asid = (asids.generation << ASID_GEN_SHIFT) | asids.next++;
+            /* A fresh ASID is cached nowhere yet */
+            proc->cpumask = 0;
+        }
+        gen = asids.generation;
+        release_spinlock(&asids.lock);
+    }
+    /* ASIDs of older generations may have been handed out again, 
+    drop whatever this core cached under them */
+    intr_push();
+    if (get_mycore()->asid_gen != gen){
+        sfence_vma_all();
+        get_mycore()->asid_gen = gen;
+    }
+    /* From now on this core may hold translations of proc */
+    __sync_fetch_and_or(&proc->cpumask, 1UL << get_coreid());
+    intr_pop();
+
+    return MAKE_SATP(proc->pagetable, proc->asid);
+}
+
+/* Flush this core's TLB entries of proc's address space */
+void proc_flush_tlb(proc_t* proc){
+    if (asids.max == 0 || proc->asid == 0)
+        sfence_vma_all();
+    else
+        sfence_vma_asid(proc->asid & SATP_ASID_MASK);
 }
 
 
@@ -0,0 +1,80 @@
+/*
+ * workqueue.c - Per-core deferred work
+ *
+ * Interrupt handlers queue a struct work on the current core's queue and 
+ * return, the core's worker kernel thread runs it later with interrupts 
+ * on. The worker takes everything queued at once, so a burst of 
+ * interrupts costs one wakeup and one lock round trip.
+ */
+#include "../include/workqueue.h"
+#include "../include/proc.h"
+#include "../include/sched.h"
+#include "../include/spinlock.h"
+#include "../include/kerror.h"
+
+static struct workqueue wqs[NCORE];
+
+void workqueue_init(){
+  for (int i = 0; i < NCORE; i++){
+    spinlock_init(&wqs[i].lock);
+    wqs[i].head = wqs[i].tail = 0;
+    wqs[i].sleeping = 0;
+    wqs[i].worker = 0;
+  }
+}
+
+/* Worker body: run queued work in batches, sleep while there is none */
+static void worker(void *arg){
+  struct workqueue *wq = (struct workqueue*)arg;
+  struct work *batch, *w;
+
+  for(;;){
+    acquire_spinlock(&wq->lock);
+    while (wq->head == 0){
+      wq->sleeping = 1;
+      sleep(wq, &wq->lock);
+    }
+    wq->sleeping = 0;
+    batch = wq->head;
+    wq->head = wq->tail = 0;
+    release_spinlock(&wq->lock);
+
+    while ((w = batch) != 0){
+      batch = w->next;
+      /* May be queued again from here on */
+      w->pending = 0;
+      w->fn(w);
+    }
+  }
+}
+
+/* Start the calling core's worker */
+void workqueue_init_hart(){
+  struct workqueue *wq = &wqs[get_coreid()];
+
+  if ((wq->worker = kthread_create(worker, wq, "kworker", 1)) == 0)
+    kerror(__FILE_NAME__,__LINE__,"workqueue_init_hart");
+}
+
+/* Queue work on the current core. Return 0 if it is already queued, it 
+  will run once for both requests then. Safe in interrupt handlers. */
+int queue_work(struct work *work){
+  struct workqueue *wq;
+
+  if (__sync_lock_test_and_set(&work->pending, 1))
+    return 0;
+  intr_push();
+  wq = &wqs[get_coreid()];
+  acquire_spinlock(&wq->lock);
+  work->next = 0;
+  if (wq->tail) wq->tail->next = work;
+  else wq->head = work;
+  wq->tail = work;
+  if (wq->sleeping){
+    wq->sleeping = 0;
+    wakeup(wq);
+  }
+  release_spinlock(&wq->lock);
+  intr_pop();
+  return 1;
+}
@@ -7,24 +7,34 @@
 #include "../include/uart.h"
 #include "../include/disk.h"
 #include "../include/proc.h"
-
-
+#include "../include/vm.h"
+#include "../include/ipi.h"
+#include "../include/timer.h"
+#include "../include/sched.h"
 void ktrap();
+extern char trap[], usertrap[], userret[];
 struct spinlock tick_lock;
 unsigned ticks;
 
+/* ticks counts TIMER_INTERVALs of mtime. A hart may sleep tickless 
+through many of them, so the count is caught up from mtime by 
+whichever hart runs next instead of incremented once per interrupt */
 void clock_isr(){
+  unsigned now = timer_now() / TIMER_INTERVAL;
+
+  sched_tick();
+  if (now == ticks)
+    return;
   acquire_spinlock(&tick_lock);
-  ticks++;
-//   wakeup(&ticks);
+  if ((int)(now - ticks) > 0)
+    ticks = now;
+  wakeup(&ticks);
   release_spinlock(&tick_lock);
 }
 
 
-void kernel_trap(){
-    uint64_t cause = read_scause();
-    uint64_t exp_code = GET_EXP_CODE(cause);
-    if (IS_INTERRUPT(cause)){
+/* Handle a device, timer or IPI interrupt, from user or kernel mode */
+static void dev_intr(uint64_t exp_code){
         if (exp_code == CAUSE_EXTI){
             int irq = trap_claim();
             if(irq == UART0_IRQ){
@@ -36,30 +46,74 @@ void kernel_trap(){
             }
             trap_complete(irq);
         }else if (exp_code == CAUSE_SOFT){
-            if(get_coreid() == 0)
-                clock_isr();
             write_sip(read_sip() & ~2);
-            if(get_myproc() != 0 && get_myproc()->state == RUNNING);
-                // yield();
+            timer_handle();
+            clock_isr();
+            /* Timer ticks and IPIs share this interrupt, the mailbox 
+               tells whether another hart asked for something */
+            ipi_handle();
         } else{
             // error
         }
-    }
-
-
-  // give up the CPU if this is a timer interrupt.
+}
 
-  // the yield() may have caused some traps to occur,
-  // so restore trap registers for use by kernelvec.S's sepc instruction.
-//   write_sepc(sepc);
-//   write_sstatus(sstatus);
+void kernel_trap(){
+    uint64_t sepc = read_sepc();
+    uint64_t sstatus = read_sstatus();
+    uint64_t cause = read_scause();
+    uint64_t exp_code = GET_EXP_CODE(cause);
+    if (IS_INTERRUPT(cause))
+        dev_intr(exp_code);
+
+    /* An interrupt only gets here with interrupts on, so the kernel 
+       code it stopped holds no spinlock: preempt it if a switch is due 
+       (timer tick, wakeup or an IPI from a remote wakeup). */
+    if (IS_INTERRUPT(cause) && get_mycore()->need_resched)
+        preempt_schedule();
+
+    /* The yield() may have caused some traps to occur, so restore trap 
+       registers for use by ktrap's sret. FS is left as the switch back 
+       set it, the FP registers may no longer be the ones saved sstatus 
+       describes. */
+    write_sepc(sepc);
+    write_sstatus((sstatus & ~SSTATUS_FS) | (read_sstatus() & SSTATUS_FS));
 }
 
 void user_trap(){
     // printk("USER TRAP\n");
     /* Now in kernel, use kernel trap instead */
-    // write_stvec((uint64_t)ktrap);
+    write_stvec((uint64_t)ktrap);
 
+    uint64_t cause = read_scause();
+    uint64_t exp_code = GET_EXP_CODE(cause);
+    if (IS_INTERRUPT(cause)){
+        dev_intr(exp_code);
+        /* User code holds no locks, give up the core if a switch is due */
+        if (get_mycore()->need_resched)
+            preempt_schedule();
+    } else if (exp_code == CAUSE_LOAD_PAGE_FAULT || exp_code == CAUSE_STORE_PAGE_FAULT){
+        /* Store to a copy-on-write page: copy it and retry the store. 
+           Otherwise it may be heap that was reserved but never touched: 
+           allocate it and retry the access. */
+        proc_t *p = get_myproc();
+        uint64_t va = read_stval();
+        if (exp_code == CAUSE_STORE_PAGE_FAULT && cow_fault(p->pagetable, va))
+            /* The page moved, cores that ran p before may cache the old one */
+            tlb_shootdown_page(p, ADDR_ROUND(va, PSIZE, 0));
+        else if (!lazy_fault(p->pagetable, p->sz, va)){
+            printk("pid %d: bad access to %p, killed\n", p->pid, va);
+            p->killed = 1;
+        }
+    } else if (exp_code == CAUSE_ILLEGAL_INST){
+        /* First FP instruction since p was switched in, load its FP 
+           registers and retry. Anything else is really illegal, the 
+           process is ended below rather than retrying it forever. */
+        proc_t *p = get_myproc();
+        if (!fp_trap(p)){
+            printk("pid %d: illegal instruction at %p, killed\n", p->pid, p->trapframe->epc);
+            p->killed = 1;
+        }
+    }
     // /** 
     //  * The scause register is an XLEN-bit read-write register.
     //  * When a trap is taken into S-mode, 
@@ -107,6 +161,38 @@ void user_trap(){
     //     }
     //  }
 
+    /* Returning would only retry the faulting instruction forever */
+    if (get_myproc()->killed)
+        proc_exit(-1);
+    usertrapret();
+}
+
+/* 
+Return to user space. Prepares the trap frame for the next user_trap(), 
+then switches to proc's page table through userret in the trampoline. 
+The satp comes from proc_satp(), which picks proc's ASID and records 
+this core in proc->cpumask so TLB shootdowns reach it. Interrupts stay 
+off from here to sret, so the core cannot change in between.
+*/
+void usertrapret(){
+    proc_t *p = get_myproc();
+    uint64_t satp;
+
+    intr_off();
+    /* Traps go to usertrap in the trampoline again */
+    write_stvec(TRAP + (usertrap - trap));
+
+    p->trapframe->kernel_satp = read_satp();
+    p->trapframe->kernel_sp = p->kstack + PSIZE*KSTACK_PAGES;
+    p->trapframe->kernel_trap = (uint64_t)user_trap;
+    p->trapframe->kernel_hartid = read_tp();
+
+    /* sret to user mode with interrupts enabled */
+    write_sstatus((read_sstatus() & ~SSTATUS_SPP) | SSTATUS_SPIE);
+    write_sepc(p->trapframe->epc);
+
+    satp = proc_satp(p);
+    ((void (*)(uint64_t))(TRAP + (userret - trap)))(satp);
 }
 
 void trap_init(){
@@ -114,5 +200,10 @@ void trap_init(){
     printk("|               trap_init                  |\n");
     printk("+------------------------------------------+\n");
     spinlock_init(&tick_lock);
+    trap_init_hart();
+}
+
+/* Install the kernel trap vector on the current hart */
+void trap_init_hart(){
     write_stvec((uint64_t)ktrap);
 }
\ No newline at end of file